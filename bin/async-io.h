@@ -0,0 +1,416 @@
+/*
+ * Input and output of the data files by chunks (option -I of disambiguation-for-KD-output.cpp).
+ *
+ * InputPrefetcher reads the list of input files in order by chunks of IO_CHUNK_BYTES. With
+ * maxChunks > 0 a reader thread reads ahead up to maxChunks chunks, across the files: while a
+ * file is processed the next ones are already being read (posix_fadvise() asks the kernel to
+ * read ahead as well). With maxChunks == 0 the chunks are read by the calling thread when
+ * needed. LineReader returns the lines of one file, like getline().
+ *
+ * OutputFile accumulates the output of a file and writes it by chunks: with an OutputFlusher
+ * thread (maxBytes > 0) the chunks are queued and written in the background, up to maxBytes
+ * pending, otherwise they are written by the calling thread.
+ *
+ * In both cases waitSeconds is the time the calling thread spent waiting for the I/O.
+ * Errors are fatal (message and exit(1)), like in the rest of the program.
+ */
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define IO_CHUNK_BYTES ((size_t) 4 << 20)
+
+
+inline double ioNowSeconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+struct InputChunk {
+  int fileNo;
+  std::string data;
+  int error; // errno if the file could not be opened or read, 0 otherwise
+  int last; // last chunk of the file
+};
+
+
+struct InputPrefetcher {
+  std::vector<std::string> files;
+  size_t maxChunks; // 0: no reader thread
+  std::thread reader;
+  std::mutex m;
+  std::condition_variable chunkAvailable;
+  std::condition_variable slotAvailable;
+  std::deque<InputChunk *> chunks;
+  int stop;
+  // without reader thread: the file being read
+  int currentFileNo;
+  int currentFd;
+};
+
+
+// reads the next chunk of the file open as fd, closes it after the last chunk
+inline InputChunk *readInputChunk(int fileNo, int fd) {
+  InputChunk *chunk = new InputChunk();
+  chunk->fileNo = fileNo;
+  chunk->error = 0;
+  chunk->last = 0;
+  chunk->data.resize(IO_CHUNK_BYTES);
+  size_t length = 0;
+  while (length < IO_CHUNK_BYTES) {
+    ssize_t n = read(fd, &chunk->data[length], IO_CHUNK_BYTES - length);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      chunk->error = errno;
+      break;
+    }
+    if (n == 0) {
+      chunk->last = 1;
+      break;
+    }
+    length += n;
+  }
+  chunk->data.resize(length);
+  if (chunk->error != 0) {
+    chunk->last = 1;
+  }
+  if (chunk->last) {
+    close(fd);
+  } else {
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    posix_fadvise(fd, offset, IO_CHUNK_BYTES, POSIX_FADV_WILLNEED);
+  }
+  return chunk;
+}
+
+
+// opens the file for readInputChunk(), returns NULL or an error chunk
+inline InputChunk *openInputFile(InputPrefetcher *p, int fileNo, int *fd) {
+  *fd = open(p->files[fileNo].c_str(), O_RDONLY);
+  if (*fd < 0) {
+    InputChunk *chunk = new InputChunk();
+    chunk->fileNo = fileNo;
+    chunk->error = errno;
+    chunk->last = 1;
+    return chunk;
+  }
+  posix_fadvise(*fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(*fd, 0, IO_CHUNK_BYTES, POSIX_FADV_WILLNEED);
+  return NULL;
+}
+
+
+inline void inputPrefetcherRun(InputPrefetcher *p) {
+  for (int fileNo=0; fileNo<(int) p->files.size(); fileNo++) {
+    int fd;
+    InputChunk *chunk = openInputFile(p, fileNo, &fd);
+    int last = 0;
+    while (!last) {
+      if (chunk == NULL) {
+	chunk = readInputChunk(fileNo, fd);
+      }
+      last = chunk->last;
+      std::unique_lock<std::mutex> lock(p->m);
+      p->slotAvailable.wait(lock, [p] { return (p->chunks.size() < p->maxChunks) || p->stop; });
+      if (p->stop) {
+	delete chunk;
+	if (!last) {
+	  close(fd);
+	}
+	return;
+      }
+      p->chunks.push_back(chunk);
+      p->chunkAvailable.notify_one();
+      chunk = NULL;
+    }
+  }
+}
+
+
+inline void startInputPrefetcher(InputPrefetcher *p, const std::vector<std::string> &files, size_t maxChunks) {
+  p->files = files;
+  p->maxChunks = maxChunks;
+  p->stop = 0;
+  p->currentFileNo = -1;
+  p->currentFd = -1;
+  if (maxChunks > 0) {
+    p->reader = std::thread(inputPrefetcherRun, p);
+  }
+}
+
+
+// the files must be read in order, every one until its last chunk
+inline InputChunk *nextInputChunk(InputPrefetcher *p, int fileNo, double *waitSeconds) {
+  double t0 = ioNowSeconds();
+  InputChunk *chunk = NULL;
+  if (p->maxChunks > 0) {
+    std::unique_lock<std::mutex> lock(p->m);
+    p->chunkAvailable.wait(lock, [p] { return p->chunks.size() > 0; });
+    chunk = p->chunks.front();
+    p->chunks.pop_front();
+    p->slotAvailable.notify_one();
+  } else {
+    if (p->currentFileNo != fileNo) {
+      p->currentFileNo = fileNo;
+      chunk = openInputFile(p, fileNo, &p->currentFd);
+    }
+    if (chunk == NULL) {
+      chunk = readInputChunk(fileNo, p->currentFd);
+    }
+  }
+  *waitSeconds += ioNowSeconds() - t0;
+  return chunk;
+}
+
+
+inline void stopInputPrefetcher(InputPrefetcher *p) {
+  if (p->maxChunks > 0) {
+    {
+      std::lock_guard<std::mutex> lock(p->m);
+      p->stop = 1;
+      p->slotAvailable.notify_all();
+    }
+    p->reader.join();
+    for (InputChunk *chunk : p->chunks) {
+      delete chunk;
+    }
+    p->chunks.clear();
+  }
+}
+
+
+struct LineReader {
+  InputPrefetcher *p;
+  int fileNo;
+  InputChunk *chunk;
+  size_t pos;
+  double waitSeconds;
+};
+
+
+// returns errno if the file could not be opened, 0 otherwise
+inline int openLineReader(LineReader &r, InputPrefetcher *p, int fileNo) {
+  r.p = p;
+  r.fileNo = fileNo;
+  r.pos = 0;
+  r.waitSeconds = 0;
+  r.chunk = nextInputChunk(p, fileNo, &r.waitSeconds);
+  return (r.chunk->data.length() == 0) ? r.chunk->error : 0;
+}
+
+
+// same as getline(): 0 at the end of the file; exits if the file cannot be read
+inline int readLine(LineReader &r, std::string &line) {
+  line.clear();
+  int found = 0;
+  while (1) {
+    const std::string &data = r.chunk->data;
+    if (r.pos < data.length()) {
+      found = 1;
+      size_t end = data.find('\n', r.pos);
+      if (end != std::string::npos) {
+	line.append(data, r.pos, end - r.pos);
+	r.pos = end + 1;
+	return 1;
+      }
+      line.append(data, r.pos, data.length() - r.pos);
+      r.pos = data.length();
+    }
+    if (r.chunk->last) {
+      if (r.chunk->error != 0) {
+	fprintf(stderr, "Error reading %s: %s\n", r.p->files[r.fileNo].c_str(), strerror(r.chunk->error));
+	exit(1);
+      }
+      return found;
+    }
+    delete r.chunk;
+    r.chunk = nextInputChunk(r.p, r.fileNo, &r.waitSeconds);
+    r.pos = 0;
+  }
+}
+
+
+inline void closeLineReader(LineReader &r) {
+  std::string line;
+  while (readLine(r, line)) {
+  }
+  delete r.chunk;
+  r.chunk = NULL;
+}
+
+
+struct OutputJob {
+  int fd;
+  const char *filename;
+  std::string data;
+  int close;
+};
+
+
+struct OutputFlusher {
+  size_t maxBytes; // 0: no flusher thread
+  std::thread flusher;
+  std::mutex m;
+  std::condition_variable jobAvailable;
+  std::condition_variable spaceAvailable;
+  std::deque<OutputJob *> jobs;
+  size_t pendingBytes;
+  int stop;
+};
+
+
+inline void writeOutputJob(OutputJob *job) {
+  size_t written = 0;
+  while (written < job->data.length()) {
+    ssize_t n = write(job->fd, job->data.data() + written, job->data.length() - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      fprintf(stderr, "Error writing %s: %s\n", job->filename, strerror(errno));
+      exit(1);
+    }
+    written += n;
+  }
+  if (job->close && (close(job->fd) != 0)) {
+    fprintf(stderr, "Error writing %s: %s\n", job->filename, strerror(errno));
+    exit(1);
+  }
+}
+
+
+inline void outputFlusherRun(OutputFlusher *f) {
+  std::unique_lock<std::mutex> lock(f->m);
+  while (1) {
+    f->jobAvailable.wait(lock, [f] { return (f->jobs.size() > 0) || f->stop; });
+    if (f->jobs.size() == 0) {
+      return;
+    }
+    OutputJob *job = f->jobs.front();
+    f->jobs.pop_front();
+    lock.unlock();
+    writeOutputJob(job);
+    lock.lock();
+    f->pendingBytes -= job->data.length();
+    f->spaceAvailable.notify_all();
+    if (job->close) {
+      delete[] job->filename;
+    }
+    delete job;
+  }
+}
+
+
+inline void startOutputFlusher(OutputFlusher *f, size_t maxBytes) {
+  f->maxBytes = maxBytes;
+  f->pendingBytes = 0;
+  f->stop = 0;
+  if (maxBytes > 0) {
+    f->flusher = std::thread(outputFlusherRun, f);
+  }
+}
+
+
+// waits until all the files are written and closed
+inline void stopOutputFlusher(OutputFlusher *f) {
+  if (f->maxBytes > 0) {
+    {
+      std::lock_guard<std::mutex> lock(f->m);
+      f->stop = 1;
+      f->jobAvailable.notify_all();
+    }
+    f->flusher.join();
+  }
+}
+
+
+struct OutputFile {
+  OutputFlusher *f;
+  int fd;
+  char *filename; // owned by the last job of the file
+  std::string buffer;
+  double waitSeconds;
+};
+
+
+// returns 0 if the file cannot be created
+inline int openOutputFile(OutputFile &out, OutputFlusher *f, const std::string &filename) {
+  out.f = f;
+  out.fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  out.filename = NULL;
+  out.buffer.clear();
+  out.waitSeconds = 0;
+  if (out.fd < 0) {
+    return 0;
+  }
+  out.filename = new char[filename.length()+1];
+  strcpy(out.filename, filename.c_str());
+  return 1;
+}
+
+
+inline void submitOutput(OutputFile &out, int close) {
+  double t0 = ioNowSeconds();
+  OutputJob *job = new OutputJob();
+  job->fd = out.fd;
+  job->filename = out.filename;
+  job->data.swap(out.buffer);
+  job->close = close;
+  if (out.f->maxBytes > 0) {
+    std::unique_lock<std::mutex> lock(out.f->m);
+    size_t bytes = job->data.length();
+    OutputFlusher *f = out.f;
+    f->spaceAvailable.wait(lock, [f, bytes] { return (f->pendingBytes == 0) || (f->pendingBytes + bytes <= f->maxBytes); });
+    f->pendingBytes += bytes;
+    f->jobs.push_back(job);
+    f->jobAvailable.notify_one();
+  } else {
+    writeOutputJob(job);
+    if (close) {
+      delete[] job->filename;
+    }
+    delete job;
+  }
+  out.buffer.reserve(IO_CHUNK_BYTES);
+  out.waitSeconds += ioNowSeconds() - t0;
+}
+
+
+inline void writeOutput(OutputFile &out, const std::string &data) {
+  out.buffer.append(data);
+  if (out.buffer.length() >= IO_CHUNK_BYTES) {
+    submitOutput(out, 0);
+  }
+}
+
+
+// the file is closed by the flusher thread after the pending chunks
+inline void closeOutputFile(OutputFile &out) {
+  submitOutput(out, 1);
+  out.buffer = std::string();
+  out.filename = NULL;
+}
+
+
+#endif
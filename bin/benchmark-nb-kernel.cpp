@@ -0,0 +1,187 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "nb-kernel.h"
+
+using namespace std;
+
+const string progName = "benchmark-nb-kernel";
+
+string nbTargetsList0 = "2:3:4:5:6:7:8";
+string nbFeatsList0 = "100:1000:10000:100000";
+double presentProb = 0.01;
+double minSeconds = 0.2;
+unsigned int seed = 1;
+
+
+void usage(ostream &out) {
+  out << "\n";
+  out << "Usage: "<< progName<<" [options]\n";
+  out << "\n";
+  out << "  Micro-benchmark of the NB scoring kernels (see nb-kernel.h) available on this\n";
+  out << "   CPU, on random tables for every combination of number of targets and number\n";
+  out << "   of features (i.e. size of the co-occurrence rows). Every kernel is checked to\n";
+  out << "   give exactly the same result as the scalar kernel.\n";
+  out << "  Prints a tab-separated line for every kernel and combination:\n";
+  out << "    <kernel> <nb targets> <nb features> <ns per call> <ns per feature> <speedup>\n";
+  out << "   where <speedup> is relative to the scalar kernel.\n";
+  out << "\n";
+  out << "  Main options:\n";
+  out << "     -h print this help message.\n";
+  out << "     -t <list> numbers of targets separated by ':'. Default: "<<nbTargetsList0<<".\n";
+  out << "     -f <list> numbers of features separated by ':'. Default: "<<nbFeatsList0<<".\n";
+  out << "     -p <prob> probability for a feature to be present in the document.\n";
+  out << "        Default: "<<presentProb<<".\n";
+  out << "     -s <seconds> min time spent for every kernel and combination. Default: "<<minSeconds<<".\n";
+  out << "     -r <seed> random seed. Default: "<<seed<<".\n";
+  out << "\n";
+}
+
+
+vector<int> splitInts(string s) {
+  vector<int> res;
+  size_t prevPos = 0;
+  size_t pos;
+  while ((pos = s.find(':', prevPos)) != string::npos) {
+    res.push_back(atoi(s.substr(prevPos, pos-prevPos).c_str()));
+    prevPos = pos + 1;
+  }
+  res.push_back(atoi(s.substr(prevPos).c_str()));
+  return res;
+}
+
+
+double nowSeconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+
+/*
+ * Random table similar to the real data: Zipfian-like unigram frequencies for the targets,
+ * joint frequencies at most the unigram frequency of the target and often zero (a feature
+ * usually co-occurs with only some of the targets).
+ */
+void generateTable(mt19937 &gen, int nbTargets, int nbFeats, int stride, vector<double> &joint, vector<uint64_t> &present, vector<double> &uni, vector<double> &prior) {
+  uniform_real_distribution<double> unif(0, 1);
+  joint.assign((size_t) nbFeats * stride, 0);
+  present.assign(nbFeats, 0);
+  uni.assign(stride, 1);
+  prior.assign(stride, 1);
+  for (int t=0; t<nbTargets; t++) {
+    uni[t] = (double) (INT64_C(1) + (int64_t) (1000000.0 * pow(unif(gen), 3)));
+    prior[t] = uni[t] / 30000000.0;
+  }
+  for (int i=0; i<nbFeats; i++) {
+    for (int t=0; t<nbTargets; t++) {
+      if (unif(gen) < 0.5) {
+	joint[(size_t) i * stride + t] = (double) (int64_t) (uni[t] * pow(unif(gen), 4));
+      }
+    }
+    if (unif(gen) < presentProb) {
+      present[i] = ~((uint64_t) 0);
+    }
+  }
+}
+
+
+// returns the mean time per call in seconds, res contains the result
+double timeKernel(NBKernel &kernel, int nbFeats, int stride, vector<double> &joint, vector<uint64_t> &present, vector<double> &uni, vector<double> &prior, vector<double> &res) {
+  long calls = 0;
+  double start = nowSeconds();
+  double elapsed;
+  do {
+    res = prior;
+    kernel.run(nbFeats, stride, joint.data(), present.data(), uni.data(), res.data());
+    calls++;
+    elapsed = nowSeconds() - start;
+  } while (elapsed < minSeconds);
+  return elapsed / calls;
+}
+
+
+int main(int argc, char **argv) {
+
+  string nbTargetsList = nbTargetsList0;
+  string nbFeatsList = nbFeatsList0;
+
+  int option;
+  while((option = getopt(argc, argv, ":ht:f:p:s:r:")) != -1){
+    switch(option){
+    case 'h':
+      usage(cout);
+      exit(0);
+    case 't':
+      nbTargetsList = optarg;
+      break;
+    case 'f':
+      nbFeatsList = optarg;
+      break;
+    case 'p':
+      presentProb = atof(optarg);
+      break;
+    case 's':
+      minSeconds = atof(optarg);
+      break;
+    case 'r':
+      seed = atoi(optarg);
+      break;
+    case ':':
+      printf("option needs a value\n");
+      break;
+    case '?':
+      printf("unknown option: %c\n", optopt);
+      break;
+    }
+  }
+  if (argc != optind) {
+    cerr << "Error, no argument expected."<<endl;
+    usage(cerr);
+    exit(1);
+  }
+
+  NBKernel kernels[3];
+  int nbKernels = availableNBKernels(kernels);
+  NBKernel scalar = kernels[nbKernels-1];
+  mt19937 gen(seed);
+  int errors = 0;
+
+  for (int nbTargets : splitInts(nbTargetsList)) {
+    for (int nbFeats : splitInts(nbFeatsList)) {
+      vector<double> joint, uni, prior, expected, res;
+      vector<uint64_t> present;
+      // reference: scalar kernel, no padding
+      generateTable(gen, nbTargets, nbFeats, nbTargets, joint, present, uni, prior);
+      double scalarTime = timeKernel(scalar, nbFeats, nbTargets, joint, present, uni, prior, expected);
+      for (int k=0; k<nbKernels; k++) {
+	// same table with the padding of this kernel
+	int stride = nbKernelStride(kernels[k], nbTargets);
+	vector<double> jointK((size_t) nbFeats * stride, 0), uniK(stride, 1), priorK(stride, 1);
+	for (int i=0; i<nbFeats; i++) {
+	  memcpy(&jointK[(size_t) i * stride], &joint[(size_t) i * nbTargets], nbTargets * sizeof(double));
+	}
+	memcpy(uniK.data(), uni.data(), nbTargets * sizeof(double));
+	memcpy(priorK.data(), prior.data(), nbTargets * sizeof(double));
+	double t = timeKernel(kernels[k], nbFeats, stride, jointK, present, uniK, priorK, res);
+	if (memcmp(res.data(), expected.data(), nbTargets * sizeof(double)) != 0) {
+	  cerr << "Error: kernel '"<<kernels[k].name<<"' gives a different result with "<<nbTargets<<" targets and "<<nbFeats<<" features"<<endl;
+	  errors++;
+	}
+	printf("%s\t%d\t%d\t%.1f\t%.3f\t%.2f\n", kernels[k].name, nbTargets, nbFeats, t * 1e9, t * 1e9 / nbFeats, scalarTime / t);
+      }
+    }
+  }
+  return (errors > 0) ? 2 : 0;
+
+}
@@ -49,6 +49,11 @@ sub usage {
 	print $fh "        every document by PMID, , e.g. list of converted Mesh descriptors.\n";
 	print $fh "        This option makes more sense with '-d 1' (article level), if used with other\n";
 	print $fh "        levels the doc-level CUIs are added for every part/element/sentence.\n";
+	print $fh "     -D <non-latest pmid versions file> deduplicate the input on the fly: rows for\n";
+	print $fh "        which <pmid>.<version> is listed in the file (output of\n";
+	print $fh "        'extract-non-latest-pmid-versions.pl') are discarded and the version suffix\n";
+	print $fh "        is removed from the other PMIDs, like 'discard-non-latest-pmid-versions.pl'.\n";
+	print $fh "        Applies to both the .cuis and .tok files. Use only with the abstracts data.\n";
 }
 
 
@@ -70,10 +75,21 @@ sub keyDependingOnDocLevel {
 }
 
 
+# on the fly deduplication: returns undef if <pmid>.<version> is a non-latest version,
+# otherwise returns the pmid without the version suffix
+sub deduplicatedPmid {
+    my ($pmidDotVersion, $nonLatest) = @_;
+
+    return undef if (defined($nonLatest->{$pmidDotVersion}));
+    my ($pmid, $version) = split ('\.', $pmidDotVersion);
+    return $pmid;
+}
+
+
 
 # PARSING OPTIONS
 my %opt;
-getopts('hr:moid:ue:', \%opt ) or  ( print STDERR "Error in options" &&  usage(*STDERR) && exit 1);
+getopts('hr:moid:ue:D:', \%opt ) or  ( print STDERR "Error in options" &&  usage(*STDERR) && exit 1);
 #$termSep = $opt{s} if (defined($opt{s}));
 usage(*STDOUT) && exit 0 if $opt{h};
 print STDERR "2 arguments expected, but ".scalar(@ARGV)." found: ".join(" ; ", @ARGV)  && usage(*STDERR) && exit 1 if (scalar(@ARGV) != 2);
@@ -85,6 +101,7 @@ my $inputAsFile = $opt{i};
 $docLevel = $opt{d} if (defined($opt{d}));
 my $unambigOnly = defined($opt{u});
 my $externalCuisByPMIDArg = $opt{e};
+my $nonLatestFile = $opt{D};
 my $minedDir = $ARGV[0];
 my $outputDir = $ARGV[1];
 
@@ -150,7 +167,21 @@ if (defined($externalCuisByPMIDArg)) {
 
 
 
+my %nonLatest;
+if (defined($nonLatestFile)) {
+    open(my $inFH,  "<", $nonLatestFile) or die "cannot open < $nonLatestFile: $!";
+    print "Reading non-latest PMID versions file '$nonLatestFile'...\n";
+    while (<$inFH>) {
+	chomp;
+	my @cols = split("\t",$_, -1);
+	$nonLatest{$cols[0].".".$cols[1]} = 1;
+    }
+    close($inFH);
+}
+
+
 my $externCuisByPMIDFound = 0;
+my $nbDiscardedNonLatest = 0;
 my $nbEntries = 0;
 my $nbFiles=scalar(@dataFiles);
 for (my $fileNo=0; $fileNo<$nbFiles; $fileNo++) {
@@ -161,10 +192,17 @@ for (my $fileNo=0; $fileNo<$nbFiles; $fileNo++) {
     die "Bug regex" if (!defined($baseFileId));
     my %selected;
     while (<$inFH>) {
-	$nbEntries++;
 	chomp;
 	my @cols =split("\t",$_);
 	die "data format error: expecting 7 columns $!" if (scalar(@cols) != 7);
+	if (defined($nonLatestFile)) {
+	    $cols[0] = deduplicatedPmid($cols[0], \%nonLatest);
+	    if (!defined($cols[0])) {
+		$nbDiscardedNonLatest++;
+		next;
+	    }
+	}
+	$nbEntries++;
 	my @cuisOrIds = split(",", $cols[4]);
 
 	if (!$unambigOnly || (scalar(@cuisOrIds)==1)) {
@@ -213,6 +251,10 @@ for (my $fileNo=0; $fileNo<$nbFiles; $fileNo++) {
 	    chomp;
 	    my @cols =split("\t",$_);
 	    my $pmid0 = $cols[0];
+	    if (defined($nonLatestFile)) {
+		$pmid0 = deduplicatedPmid($pmid0, \%nonLatest);
+		next if (!defined($pmid0));
+	    }
 	    my $year = $cols[1];
 	    my $docType = $cols[2];
 	    my $docId = $cols[3];
@@ -251,5 +293,6 @@ print "\n";
 
 
 print "$nbEntries processed\n";
+print "Discarded non-latest PMID versions: $nbDiscardedNonLatest entries.\n" if (defined($nonLatestFile));
 print "External CUIs by PMID: additional CUIs found for $externCuisByPMIDFound entries (".($externCuisByPMIDFound/$nbEntries*100)." %).\n" if (defined($externalCuisByPMIDArg));
 
@@ -0,0 +1,621 @@
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <thread>
+
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+using namespace std;
+
+const string progName = "convert-mesh-to-cui";
+
+const int umlsCUIColNo = 1; // 1-indexed col no for the CUI in MRCONSO.RRF
+const int umlsLangColNo = 2; // 1-indexed col no for the language in MRCONSO.RRF
+const string umlsLangFilterVal = "ENG";
+const int umlsMeshIdColNo = 11;
+
+const char cacheMagic[8] = { 'K', 'D', 'M', 'S', 'H', 'C', 'U', '2' }; // last char: format version
+
+string multipleCUIs0 = "fail";  // 'fail', 'mesh", 'cuis'
+int ignoreNotFound = 0;
+string listOfMeshSep;
+int majorYNFormat = 0;
+int keepColumns = 0;
+vector<int> keepColumnsNos; // empty = all
+int nbThreads = 0;
+size_t chunkSize = 16 * 1024 * 1024;
+
+
+void usage(ostream &out) {
+  out << "\n";
+  out << "Usage: "<< progName<<" [options] <UMLS META dir> <input file> <col no>\n";
+  out << "\n";
+  out << "  Native version of 'convert-mesh-to-cui.pl': prints the list (column) of CUIs\n";
+  out << "   corresponding to the Mesh descriptors in <col no> from <input file>.\n";
+  out << "  <col no> can contain a list of columns nos, e.g. '1,3,5'. In this case\n";
+  out << "   the same number of columns in printed.\n";
+  out << "  MRCONSO.RRF is read only once (or not at all with -C) and the input file is\n";
+  out << "   read only once for all the modes given with -m.\n";
+  out << "\n";
+  out << "  Main options:\n";
+  out << "     -h print this help message.\n";
+  out << "     -i ignore when the mesh descriptor is not found in UMLS, just print\n";
+  out << "        the original value instead.\n";
+  out << "     -m <fail|mesh|cuis> in case a mesh descriptor has Multiple corresponding\n";
+  out << "        CUIs, either:\n";
+  out << "          - 'fail' (default)\n";
+  out << "          - print the orginal 'mesh' descriptor\n";
+  out << "          - print the list of 'cuis' (Caution: this can cause ambiguity issues)\n";
+  out << "            this option requires '-l' to provide a separator.\n";
+  out << "        Several modes can be given separated by ':', e.g. 'cuis:mesh'; this\n";
+  out << "        requires -o.\n";
+  out << "     -l <sep> allows the mesh column to contain a list of mesh descriptors\n";
+  out << "        separated by <sep>. Each descriptor is converted and the same\n";
+  out << "        separator is used in the output. An empty list is allowed.\n";
+  out << "     -M Mesh descriptors in input file with MajorYN indicator, e.g. 'D008955|N;'\n";
+  out << "        The '|Y' or '|N' is ignored.\n";
+  out << "     -k keep original columns, i.e. add converted column.\n";
+  out << "     -K <cols> keep only these original columns, e.g. '1-4' or '1,3'. Implies -k.\n";
+  out << "     -o <prefix> write the output for every mode <m> to '<prefix>.<m>.tsv' instead\n";
+  out << "        of STDOUT.\n";
+  out << "     -C <cache file> binary cache of the Mesh to CUIs table: read from <cache file>\n";
+  out << "        if it exists, otherwise MRCONSO.RRF is read and the table is saved to\n";
+  out << "        <cache file>. The cache is rebuilt if MRCONSO.RRF is not the one it was\n";
+  out << "        built from (path, size and modification time).\n";
+  out << "     -t <nb threads> number of threads used to convert the input file. Default:\n";
+  out << "        number of cores.\n";
+  out << "\n";
+}
+
+
+vector<string> split(string s, char sep) {
+  vector<string> res = vector<string>();
+  size_t prevPos=0;
+  size_t pos = s.find(sep, prevPos);
+  while (pos != string::npos) {
+    res.push_back(s.substr(prevPos, pos-prevPos));
+    prevPos=pos+1;
+    pos = s.find(sep,prevPos);
+  }
+  res.push_back(s.substr(prevPos));
+  return res;
+}
+
+
+// like perl 'split' without limit: trailing empty fields are removed
+vector<string> splitNoTrailingEmpty(string s, char sep) {
+  vector<string> res = split(s, sep);
+  while ((res.size()>0) && (res.back().length()==0)) {
+    res.pop_back();
+  }
+  return res;
+}
+
+
+// parses '1-4,6' into [1,2,3,4,6]
+vector<int> parseColumnsList(string s) {
+  vector<int> res;
+  for (string part : split(s, ',')) {
+    vector<string> range = split(part, '-');
+    int from = atoi(range[0].c_str());
+    int to = (range.size()>1) ? atoi(range[1].c_str()) : from;
+    if ((from < 1) || (to < from)) {
+      cerr << "Error: invalid columns list '"<<s<<"'"<<endl;
+      exit(1);
+    }
+    for (int i=from; i<=to; i++) {
+      res.push_back(i);
+    }
+  }
+  return res;
+}
+
+
+/*
+ * Compact Mesh id -> CUIs table: sorted Mesh ids stored in a single char pool, CUIs stored
+ * as their numeric part in a single array; mesh no i has CUIs cuis[cuisStart[i]..cuisStart[i+1]-1]
+ */
+struct MeshCuiTable {
+  vector<char> meshPool;
+  vector<uint32_t> meshOffset; // nbMesh entries
+  vector<uint32_t> cuisStart;  // nbMesh+1 entries
+  vector<uint32_t> cuis;
+};
+
+
+uint32_t cuiToNumber(const string &cui) {
+  if ((cui.length() != 8) || (cui[0] != 'C') || (strspn(cui.c_str()+1, "0123456789") != 7)) {
+    cerr << "Error: unexpected CUI format '"<<cui<<"'"<<endl;
+    exit(5);
+  }
+  return strtoul(cui.c_str()+1, NULL, 10);
+}
+
+
+void appendCui(string &out, uint32_t cuiNo) {
+  char buff[16];
+  sprintf(buff, "C%07u", cuiNo);
+  out += buff;
+}
+
+
+MeshCuiTable *readMrconso(string filename) {
+
+  ifstream file(filename);
+  if (!file) {
+    cerr << "Error opening "<< filename << endl;
+    exit(1);
+  }
+  vector<pair<string, uint32_t>> meshCui;
+  string str;
+  long lineNo=0;
+  while (getline(file, str)) {
+    // only the first columns are needed, avoid splitting the whole line
+    size_t start = 0;
+    string cols[umlsMeshIdColNo];
+    int colNo;
+    for (colNo=0; colNo<umlsMeshIdColNo; colNo++) {
+      size_t pos = str.find('|', start);
+      cols[colNo] = str.substr(start, (pos == string::npos) ? string::npos : pos-start);
+      if (pos == string::npos) {
+	break;
+      }
+      start = pos+1;
+    }
+    if (cols[umlsLangColNo-1] == umlsLangFilterVal) { // filter in English language
+      string &mesh = cols[umlsMeshIdColNo-1];
+      if (mesh.length()>0) {
+	meshCui.push_back({ mesh, cuiToNumber(cols[umlsCUIColNo-1]) });
+      }
+    }
+    lineNo++;
+    if (lineNo % 65536 == 0) {
+      fprintf(stderr,"\r line %ld ",lineNo);
+    }
+  }
+  cerr << endl;
+  file.close();
+
+  sort(meshCui.begin(), meshCui.end());
+  meshCui.erase(unique(meshCui.begin(), meshCui.end()), meshCui.end());
+
+  MeshCuiTable *t = new MeshCuiTable();
+  for (size_t i=0; i<meshCui.size(); i++) {
+    if ((i==0) || (meshCui[i].first != meshCui[i-1].first)) {
+      t->meshOffset.push_back(t->meshPool.size());
+      t->meshPool.insert(t->meshPool.end(), meshCui[i].first.begin(), meshCui[i].first.end());
+      t->meshPool.push_back('\0');
+      t->cuisStart.push_back(t->cuis.size());
+    }
+    t->cuis.push_back(meshCui[i].second);
+  }
+  t->cuisStart.push_back(t->cuis.size());
+  return t;
+}
+
+
+template <typename T>
+void writeVector(FILE *f, vector<T> &v) {
+  uint64_t n = v.size();
+  fwrite(&n, sizeof(n), 1, f);
+  fwrite(v.data(), sizeof(T), n, f);
+}
+
+
+template <typename T>
+int readVector(FILE *f, vector<T> &v) {
+  uint64_t n;
+  if (fread(&n, sizeof(n), 1, f) != 1) {
+    return 0;
+  }
+  v.resize(n);
+  return (fread(v.data(), sizeof(T), n, f) == n);
+}
+
+
+// identifies the MRCONSO.RRF file the cache is built from: '<path> <size> <mtime>'
+string cacheSource(string mrconso) {
+  char path[PATH_MAX];
+  struct stat sb;
+  string s = (realpath(mrconso.c_str(), path) != NULL) ? string(path) : mrconso;
+  if (stat(mrconso.c_str(), &sb) == 0) {
+    s += "\t"+to_string((long long) sb.st_size)+"\t"+to_string((long long) sb.st_mtime);
+  }
+  return s;
+}
+
+
+// written to '<filename>.tmp' then renamed, so that an interrupted run leaves no partial cache
+void writeCache(string filename, MeshCuiTable *t, string source) {
+  string tmpFile = filename+".tmp";
+  FILE *f = fopen(tmpFile.c_str(), "wb");
+  if (f == NULL) {
+    cerr << "Error opening "<< tmpFile << endl;
+    exit(1);
+  }
+  vector<char> sourceChars(source.begin(), source.end());
+  fwrite(cacheMagic, sizeof(cacheMagic), 1, f);
+  writeVector(f, sourceChars);
+  writeVector(f, t->meshPool);
+  writeVector(f, t->meshOffset);
+  writeVector(f, t->cuisStart);
+  writeVector(f, t->cuis);
+  if ((fclose(f) != 0) || (rename(tmpFile.c_str(), filename.c_str()) != 0)) {
+    cerr << "Error writing "<< filename << endl;
+    exit(1);
+  }
+}
+
+
+// returns NULL if the file does not exist, has an older format or was built from another source
+MeshCuiTable *readCache(string filename, string source) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  char magic[sizeof(cacheMagic)];
+  vector<char> sourceChars;
+  MeshCuiTable *t = new MeshCuiTable();
+  if ((fread(magic, sizeof(magic), 1, f) == 1) && (memcmp(magic, cacheMagic, sizeof(magic)-1) == 0) && (magic[sizeof(magic)-1] != cacheMagic[sizeof(magic)-1])) {
+    cerr << "Cache file '"<<filename<<"' has an older format, rebuilding it"<< endl;
+    fclose(f);
+    delete t;
+    return NULL;
+  }
+  if ((memcmp(magic, cacheMagic, sizeof(magic)) != 0) || !readVector(f, sourceChars)) {
+    cerr << "Error: invalid cache file '"<<filename<<"'"<< endl;
+    exit(5);
+  }
+  if (string(sourceChars.begin(), sourceChars.end()) != source) {
+    cerr << "Cache file '"<<filename<<"' was built from another MRCONSO.RRF, rebuilding it"<< endl;
+    fclose(f);
+    delete t;
+    return NULL;
+  }
+  if (!readVector(f, t->meshPool) || !readVector(f, t->meshOffset) || !readVector(f, t->cuisStart) || !readVector(f, t->cuis) ||
+      (t->cuisStart.size() != t->meshOffset.size()+1)) {
+    cerr << "Error: invalid cache file '"<<filename<<"'"<< endl;
+    exit(5);
+  }
+  fclose(f);
+  return t;
+}
+
+
+// returns the mesh no, or -1 if not found
+long findMesh(MeshCuiTable *t, const string &mesh) {
+  const char *pool = t->meshPool.data();
+  long left = 0;
+  long right = (long) t->meshOffset.size() - 1;
+  while (left <= right) {
+    long mid = (left + right) / 2;
+    int c = strcmp(pool + t->meshOffset[mid], mesh.c_str());
+    if (c == 0) {
+      return mid;
+    } else if (c < 0) {
+      left = mid + 1;
+    } else {
+      right = mid - 1;
+    }
+  }
+  return -1;
+}
+
+
+/*
+ * A chunk of the input file, converted independently by a thread for every mode.
+ */
+struct Chunk {
+  string data;
+  vector<string> output; // by mode
+  set<string> notFound;
+  string error; // empty if no error
+};
+
+
+void convertChunk(Chunk *chunk, MeshCuiTable *table, vector<string> *modes, vector<int> *colsNos) {
+  size_t nbModes = modes->size();
+  chunk->output.assign(nbModes, string());
+  size_t start = 0;
+  while (start < chunk->data.length()) {
+    size_t end = chunk->data.find('\n', start);
+    if (end == string::npos) {
+      end = chunk->data.length();
+    }
+    vector<string> cols = split(chunk->data.substr(start, end-start), '\t');
+    start = end+1;
+    vector<string> out(nbModes);
+    for (size_t i=0; i<colsNos->size(); i++) {
+      int colNo = (*colsNos)[i];
+      if ((size_t) colNo > cols.size()) {
+	chunk->error = "Error: not enough columns in input line";
+	return;
+      }
+      string &meshStr = cols[colNo-1];
+      vector<string> meshDescrs;
+      if (listOfMeshSep.length()>0) {
+	meshDescrs = splitNoTrailingEmpty(meshStr, listOfMeshSep[0]);
+      } else {
+	meshDescrs.push_back(meshStr);
+      }
+      vector<string> thisColOutput(nbModes);
+      vector<int> thisColEmpty(nbModes, 1);
+      for (string &mesh0 : meshDescrs) {
+	string mesh = majorYNFormat ? mesh0.substr(0, mesh0.find('|')) : mesh0;
+	long meshNo = findMesh(table, mesh);
+	if (meshNo < 0) {
+	  if (!ignoreNotFound) {
+	    chunk->error = "Error: no UMLS entry found for Mesh '"+mesh+"'";
+	    return;
+	  }
+	  chunk->notFound.insert(mesh);
+	}
+	for (size_t modeNo=0; modeNo<nbModes; modeNo++) {
+	  string &o = thisColOutput[modeNo];
+	  if (meshNo >= 0) {
+	    uint32_t first = table->cuisStart[meshNo];
+	    uint32_t last = table->cuisStart[meshNo+1];
+	    if ((last - first > 1) && ((*modes)[modeNo] != "cuis")) {
+	      if ((*modes)[modeNo] == "fail") {
+		string cuisList;
+		for (uint32_t j=first; j<last; j++) {
+		  cuisList += (j>first) ? ", " : "";
+		  appendCui(cuisList, table->cuis[j]);
+		}
+		chunk->error = "Problem: several CUIs corresponding to MEsh '"+mesh+"': "+cuisList;
+		return;
+	      }
+	      if (!thisColEmpty[modeNo]) {
+		o += listOfMeshSep;
+	      }
+	      o += mesh;
+	    } else {
+	      for (uint32_t j=first; j<last; j++) {
+		if (!thisColEmpty[modeNo]) {
+		  o += listOfMeshSep;
+		}
+		appendCui(o, table->cuis[j]);
+		thisColEmpty[modeNo] = 0;
+	      }
+	    }
+	  } else {
+	    if (!thisColEmpty[modeNo]) {
+	      o += listOfMeshSep;
+	    }
+	    o += mesh;
+	  }
+	  thisColEmpty[modeNo] = 0;
+	}
+      }
+      for (size_t modeNo=0; modeNo<nbModes; modeNo++) {
+	if (i>0) {
+	  out[modeNo] += "\t";
+	}
+	out[modeNo] += thisColOutput[modeNo];
+      }
+    }
+    string kept;
+    if (keepColumns) {
+      if (keepColumnsNos.size()==0) {
+	for (string &c: cols) {
+	  kept += c + "\t";
+	}
+      } else {
+	for (int colNo : keepColumnsNos) {
+	  if ((size_t) colNo <= cols.size()) {
+	    kept += cols[colNo-1];
+	  }
+	  kept += "\t";
+	}
+      }
+    }
+    for (size_t modeNo=0; modeNo<nbModes; modeNo++) {
+      chunk->output[modeNo] += kept + out[modeNo] + "\n";
+    }
+  }
+}
+
+
+// reads the next chunk of approximately chunkSize bytes, ending at the end of a line
+int readChunk(ifstream &inFH, Chunk *chunk) {
+  chunk->notFound.clear();
+  chunk->error.clear();
+  chunk->data.resize(chunkSize);
+  inFH.read(&chunk->data[0], chunkSize);
+  chunk->data.resize(inFH.gcount());
+  if (chunk->data.length() == 0) {
+    return 0;
+  }
+  if (chunk->data.back() != '\n') {
+    string rest;
+    if (getline(inFH, rest)) {
+      chunk->data += rest;
+    }
+  } else {
+    chunk->data.pop_back();
+  }
+  return 1;
+}
+
+
+int main(int argc, char **argv) {
+
+  string outputPrefix;
+  string cacheFile;
+
+  int option;
+  while((option = getopt(argc, argv, ":him:l:kK:MC:o:t:")) != -1){
+    switch(option){
+    case 'h':
+      usage(cout);
+      exit(0);
+    case 'i':
+      ignoreNotFound = 1;
+      break;
+    case 'm':
+      multipleCUIs0 = optarg;
+      break;
+    case 'l':
+      listOfMeshSep = optarg;
+      break;
+    case 'k':
+      keepColumns = 1;
+      break;
+    case 'K':
+      keepColumns = 1;
+      keepColumnsNos = parseColumnsList(optarg);
+      break;
+    case 'M':
+      majorYNFormat = 1;
+      break;
+    case 'C':
+      cacheFile = optarg;
+      break;
+    case 'o':
+      outputPrefix = optarg;
+      break;
+    case 't':
+      nbThreads = atoi(optarg);
+      break;
+    case ':':
+      printf("option needs a value\n");
+      break;
+    case '?':
+      printf("unknown option: %c\n", optopt);
+      break;
+    }
+  }
+
+  if (argc != optind+3) {
+    cerr << "Error, 3 arguments required."<<endl;
+    usage(cerr);
+    exit(1);
+  }
+  string umlsDir = argv[optind+0];
+  string inputFile = argv[optind+1];
+  vector<int> colsNos;
+  for (string c : split(argv[optind+2], ',')) {
+    char *end;
+    long colNo = strtol(c.c_str(), &end, 10);
+    if ((c.length()==0) || (*end != '\0') || (colNo < 1)) {
+      cerr << "Error: invalid column number '"<<c<<"', expecting a list of numbers >= 1"<<endl;
+      exit(1);
+    }
+    colsNos.push_back(colNo);
+  }
+
+  vector<string> modes = split(multipleCUIs0, ':');
+  for (string &mode : modes) {
+    if ((mode != "fail") && (mode != "mesh") && (mode != "cuis")) {
+      cerr << "invalid value for option '-m'; '"<<mode<<"'."<<endl;
+      exit(1);
+    }
+    if ((mode == "cuis") && (listOfMeshSep.length()==0)) {
+      cerr << "Error: must provide -l with option '-m cuis'"<<endl;
+      exit(1);
+    }
+  }
+  if ((modes.size()>1) && (outputPrefix.length()==0)) {
+    cerr << "Error: must use -o with multiple modes."<<endl;
+    exit(1);
+  }
+  if (nbThreads <= 0) {
+    nbThreads = thread::hardware_concurrency();
+    if (nbThreads <= 0) {
+      nbThreads = 1;
+    }
+  }
+
+  string mrconso = umlsDir+"/MRCONSO.RRF";
+  string source = cacheSource(mrconso);
+  MeshCuiTable *table = NULL;
+  if (cacheFile.length()>0) {
+    table = readCache(cacheFile, source);
+    if (table != NULL) {
+      cerr << "Read Mesh to CUIs table from cache '"<<cacheFile<<"'"<<endl;
+    }
+  }
+  if (table == NULL) {
+    cerr << "Reading UMLS '"<<mrconso<<"'..."<<endl;
+    table = readMrconso(mrconso);
+    if (cacheFile.length()>0) {
+      cerr << "Writing Mesh to CUIs table to cache '"<<cacheFile<<"'"<<endl;
+      writeCache(cacheFile, table, source);
+    }
+  }
+
+  vector<ostream *> outFHs;
+  for (string &mode : modes) {
+    if (outputPrefix.length()>0) {
+      string f = outputPrefix+"."+mode+".tsv";
+      ofstream *fh = new ofstream(f);
+      if (!*fh) {
+	cerr << "Error opening "<< f << endl;
+	exit(1);
+      }
+      outFHs.push_back(fh);
+    } else {
+      outFHs.push_back(&cout);
+    }
+  }
+
+  ifstream inFH(inputFile);
+  if (!inFH) {
+    cerr << "Error opening "<< inputFile << endl;
+    exit(1);
+  }
+
+  // batches of nbThreads chunks are read sequentially, converted in parallel and then written in order
+  set<string> notFound;
+  vector<Chunk> chunks(nbThreads);
+  long chunkNo = 0;
+  int nbRead;
+  do {
+    for (nbRead=0; (nbRead < nbThreads) && readChunk(inFH, &chunks[nbRead]); nbRead++) { }
+    vector<thread> threads;
+    for (int i=0; i<nbRead; i++) {
+      threads.push_back(thread(convertChunk, &chunks[i], table, &modes, &colsNos));
+    }
+    for (int i=0; i<nbRead; i++) {
+      threads[i].join();
+      if (chunks[i].error.length()>0) {
+	cerr << chunks[i].error << endl;
+	exit(1);
+      }
+      for (size_t modeNo=0; modeNo<modes.size(); modeNo++) {
+	*outFHs[modeNo] << chunks[i].output[modeNo];
+      }
+      notFound.insert(chunks[i].notFound.begin(), chunks[i].notFound.end());
+      chunkNo++;
+      fprintf(stderr,"\r chunk %ld ",chunkNo);
+    }
+  } while (nbRead == nbThreads);
+  cerr << endl;
+  inFH.close();
+
+  for (size_t modeNo=0; modeNo<modes.size(); modeNo++) {
+    outFHs[modeNo]->flush();
+    if (outFHs[modeNo] != &cout) {
+      delete outFHs[modeNo];
+    }
+  }
+
+  if (ignoreNotFound) {
+    cerr << "Values not found in UMLS: ";
+    for (set<string>::iterator it = notFound.begin(); it != notFound.end(); it++) {
+      cerr << ((it != notFound.begin()) ? "," : "") << *it;
+    }
+    cerr << endl;
+  }
+
+}
@@ -2,19 +2,34 @@
 #include <iostream>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <set>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <iomanip>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <libgen.h>
+#include <limits.h>
 #include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
 
-#define INT long int
+#include "kd-disambiguation.h"
+#include "pairs-store.h"
+#include "async-io.h"
 
 using namespace std;
 
@@ -25,6 +40,17 @@ string method0 = "advanced";
 int ignoreTargetIfNotInPairsData = 0;
 int advancedDiscriminativeFeatsOnly = 1;
 vector<string> externalCuisByPmidOpts;
+string externalCuisSnapshotFile;
+string nonLatestPmidVersionsFile;
+double statsJsonDumpPeriod = 0;
+double memoryEstimateSamplingRate = 0; // option -S, disabled if zero
+int hotGroupsTopN = 0; // option -P, disabled if zero
+NBKernel nbKernel; // selected at runtime, see nb-kernel.h
+size_t batchSize = 1; // option -W
+int nbThreads = 1; // option -t
+size_t ioReadAheadChunks = 0; // option -I, 0: synchronous I/O
+OutputFlusher *outputFlusher = NULL; // not a global object: exit() must not wait for its thread
+mutex diagnosticsMutex; // profiler and equivalence report, shared by the worker threads
 
 INT totalNbDocs;
 
@@ -37,11 +63,176 @@ INT uniqueSuccess = 0;
 INT uniqueUnknownTarget = 0;
 INT uniqueMethodNA = 0;
 INT uniqueThrehsholdReject = 0;
+INT totalDiscardedNonLatestVersion = 0;
+
+// equivalence check with the legacy implementation (option -X)
+double equivalenceTolerance = -1; // disabled if negative
+ofstream *equivalenceFH = NULL;
+INT equivalenceChecked = 0;
+INT equivalenceMismatches = 0;
+INT equivalenceExplained = 0;
+
+// truncation of the co-occurrence rows (options -k, -j, -i) and comparison with the full data (option -R)
+string topKNeighbours0; // no top-K truncation if empty
+INT topKNeighbours = 0; // current value, 0 if no top-K truncation
+INT minJointFreq = 0;
+double minPMI = -INFINITY;
+int truncationReport = 0;
+INT truncationTransitions[4][4]; // [outcome with full data][outcome with truncated data]
+INT truncationOtherCui = 0; // success in both cases but different CUI selected
+INT jointFreqEntries = 0;
+INT fullJointFreqEntries = 0;
+
+// decision store (option -U), see reuseStoredDecisions()
+string decisionStoreFile;
+unordered_map<string, string> storedDecisions; // '<config>\t<pmid>\t<content hash>' -> decisions of the cases
+ofstream *decisionStoreFH = NULL; // the new decisions are appended
+string decisionStoreConfig; // fingerprint of the current parameters and resources
+uint64_t pairsDataFingerprint = FNV1A_OFFSET_BASIS;
+INT decisionStoreLookups = 0;
+INT decisionStoreReused = 0;
+INT decisionStoreReusedCases = 0;
+
+// pairs data, see pairs-store.h
+PairsStore pairsStore;
+PackedRows *&packedJointFreq = pairsStore.packedJointFreq; // option -C: replaces jointFreq (empty), rows by id in the CUIs dictionary
+unordered_map<string, unordered_map<string, INT>*> *&fullJointFreq = pairsStore.fullJointFreq; // only with option -R
+// option -C with -X or -R: the pairs data also loaded as hash maps, for the legacy functions and the full data
+PairsStore legacyPairsStore;
+unordered_map<string, unordered_map<string, INT>*> *legacyJointFreq = NULL; // rows for the legacy functions (-X)
+
+// option -H: placement of the compact rows (see memory-placement.h)
+string pairsPlacement;
+double replicatedPercent = 25; // 'replicate:<percent>': proportion of the entries in the rows replicated
+vector<NumaNode> numaNodesList;
+vector<MemoryPlacement *> placements;
+vector<PackedRows *> &packedReplicas = pairsStore.packedReplicas; // 'replicate': the most frequent rows on every NUMA node, by node no
+int pinWorkers = 0; // worker w pinned to node w modulo the number of nodes
 
 
 int minFreqThresholdDone = 0;
 
 
+/*
+ * Instrumentation written to the JSON sidecar of the '.stats' file (see writeStatsJson):
+ * loading times are for the whole run, the other values are reset with the stats.
+ */
+const int nbScoringTimeBuckets = 24; // bucket i: calls which took less than 2^i microseconds (last: any)
+
+struct Instrumentation {
+  double loadRefFile;
+  double loadExternal;
+  double loadNonLatest;
+  double loadPairs;
+  double processingStart;
+  double lastJsonDump;
+  INT files;
+  INT rows;
+  INT docs;
+  double features;
+  double scoring;
+  double writing;
+  double inputWait; // see async-io.h
+  double outputWait;
+  INT scoringTimeHistogram[nbScoringTimeBuckets];
+};
+Instrumentation timing;
+
+/*
+ * Counters updated while processing a batch of documents, added to the global counters and
+ * instrumentation when the batch is written: with option -t the batches are processed by
+ * several threads but written by a single one.
+ */
+struct BatchCounters {
+  INT rows;
+  INT docs;
+  INT discardedNotInPairsData;
+  INT uniqueTotalCases;
+  INT uniqueByOutcome[4];
+  INT equivalenceChecked;
+  INT equivalenceMismatches;
+  INT equivalenceExplained;
+  INT truncationTransitions[4][4];
+  INT truncationOtherCui;
+  INT storeLookups;
+  INT storeReused;
+  INT storeReusedCases;
+  double features;
+  double scoring;
+  INT scoringTimeHistogram[nbScoringTimeBuckets];
+};
+
+/*
+ * Memory accounting (see the section 'Memory accounting' below): approximate number of bytes
+ * used by every main structure. The loaded resources are accounted once after loading,
+ * the target groups cache at the time of writing the stats and the per-document state is
+ * the peak over the run.
+ */
+struct MemoryBreakdown {
+  size_t uniFreq;
+  size_t jointFreqIndex;
+  size_t jointFreqRows;
+  size_t idToCui;
+  size_t cuiDictionary;
+  size_t external;
+  size_t nonLatest;
+  size_t targetGroupsCache;
+  size_t decisionStore;
+  size_t perDocPeak;
+};
+MemoryBreakdown memory;
+
+// CUIs dictionary: the compact structures store CUIs as ids in this dictionary
+vector<string> cuiNames;
+unordered_map<string, uint32_t> cuiIdByName;
+
+// CUIs dictionary of the compact pairs data (option -C), ids ranked by decreasing frequency: the
+// CUIs with frequency >= f are the ids below packedIdCutoff(f), see readPairsDataPacked()
+vector<string> &pairsCuiNames = pairsStore.cuiNames;
+unordered_map<string, uint32_t> &pairsCuiIdByName = pairsStore.cuiIdByName;
+vector<INT> &pairsUniFreqById = pairsStore.uniFreqById;
+
+/*
+ * Resolved content of a CUIs/ids field from the input data, e.g. '123,456': CUIs in the original
+ * order (after option -d if enabled) and the sorted list as printed when not disambiguated.
+ * Groups are cached by field, the cache is valid only for the current parameters. There is one
+ * cache by worker thread (option -t).
+ */
+struct GroupProfile;
+
+struct TargetGroup {
+  vector<string> cuis;
+  string sortedCuisStr;
+  GroupProfile *profile; // only with option -P, NULL until the group is scored
+};
+vector<unordered_map<string, TargetGroup>> targetGroupsCaches(1);
+
+/*
+ * Hot ambiguity groups profiler (option -P): statistics by group of targets (identified by the
+ * sorted CUIs), valid for the current parameters like the other stats.
+ */
+struct GroupProfile {
+  INT calls; // number of unique ambiguity cases
+  size_t rowsSize; // total size of the jointFreq rows of the targets
+  double scoring; // cumulative scoring time
+  INT outcomes[4]; // by outcome, see enum below
+};
+unordered_map<string, GroupProfile> groupProfiles;
+
+const char externalSnapshotMagic[8] = { 'K', 'D', 'E', 'X', 'T', 'R', 'S', '2' }; // last char: format version
+
+
+/*
+ * External resource (option -e) stored in CSR format: the PMIDs are sorted and the CUIs for
+ * pmids[i] are cuiIds[cuisStart[i]..cuisStart[i+1]-1] (ids in the CUIs dictionary).
+ */
+struct ExternalResource {
+  vector<uint32_t> pmids;
+  vector<uint32_t> cuisStart;
+  vector<uint32_t> cuiIds;
+};
+
+
 void usage(ostream &out) {
   out << "\n";
   out << "Usage: ls <input files> | "<< progName<<" [options] <nb docs> <pairs stats file> <output dir>\n";
@@ -75,6 +266,83 @@ void usage(ostream &out) {
   out << "        every document by PMID, , e.g. list of converted Mesh descriptors. This\n";
   out << "        option is supposed to be used if the <pairs stats file> is obtained using\n";
   out << "        the same external resource (typically converted Mesh descriptors).\n";
+  out << "     -E <snapshot file> binary snapshot of the external resource: if <snapshot file>\n";
+  out << "        exists the resource is loaded from it (-e is not needed), otherwise the\n";
+  out << "        resource given with -e is read and saved to <snapshot file>. With -e the\n";
+  out << "        snapshot is rebuilt if it was built from another file (path, size or\n";
+  out << "        modification time) or with other columns or separator.\n";
+  out << "     -X <tolerance> equivalence check: every unique ambiguity case is also processed\n";
+  out << "        by the legacy implementation of the method and the decisions are compared\n";
+  out << "        (same outcome, same selected CUI, posterior probabilities within <tolerance>).\n";
+  out << "        Differences are written to '<output dir>.equivalence.tsv' together with the\n";
+  out << "        features of the case. A difference is 'explained' if the posteriors are within\n";
+  out << "        <tolerance> (e.g. case at the threshold boundary).\n";
+  out << "     -S <sampling rate> memory estimate mode: nothing is processed (no input files read\n";
+  out << "        from STDIN), instead the resources which would be loaded with the same options\n";
+  out << "        are sampled and their resident size is estimated and printed to STDOUT, with\n";
+  out << "        the options -f, -k, -j, -i and -C. A proportion <sampling rate> (e.g. 0.01) of\n";
+  out << "        the lines of every file is parsed, evenly spaced; 1 parses every line.\n";
+  out << "        The breakdown of the memory actually used is written to the '.stats' file anyway.\n";
+  out << "     -P <N> hot ambiguity groups profiler: records for every group of targets the\n";
+  out << "        number of unique cases, the total size of the targets co-occurrence rows, the\n";
+  out << "        cumulative scoring time and the outcomes. The top <N> groups by scoring time\n";
+  out << "        are written to '<output dir>.hot-groups.tsv' after every input file.\n";
+  out << "     -K <kernel> use this implementation of the NB scoring kernel: 'avx512', 'avx2'\n";
+  out << "        or 'scalar' (the results are identical). Default: the best one supported by\n";
+  out << "        the CPU.\n";
+  out << "     -W <nb docs> process the documents by batches of <nb docs>: the ambiguity cases\n";
+  out << "        of the batch are scored grouped by group of targets, which is faster for\n";
+  out << "        the NB method (the table for the targets is computed once for the group).\n";
+  out << "        The output is identical. Default: 1 (every document processed separately).\n";
+  out << "     -t <nb threads> process every input file with a pipeline: the batches of\n";
+  out << "        documents (see -W) are read by the main thread, processed by <nb threads>\n";
+  out << "        worker threads and written in order by another thread. The output is\n";
+  out << "        identical. Use with -W, e.g. -W 100. Default: 1 (no additional thread).\n";
+  out << "     -I <N> asynchronous I/O: a thread reads ahead up to <N> chunks of 4 MB of the\n";
+  out << "        input files, including the next files, and another thread writes the output\n";
+  out << "        with up to <N> chunks pending. The time spent waiting for the I/O is given in\n";
+  out << "        the '.stats.json' file. Default: 0 (the files are read and written by the\n";
+  out << "        thread which reads the batches, see -t).\n";
+  out << "     -k <K> keep only the top <K> co-occurring CUIs by joint frequency for every CUI\n";
+  out << "        in the pairs data (ties: lowest CUI first). This makes the NB and advanced\n";
+  out << "        methods faster and the pairs data smaller, at the cost of some decisions (see\n";
+  out << "        -R). With -M a list of values separated by ':' can be given, the pairs data is\n";
+  out << "        truncated for every value in decreasing order.\n";
+  out << "     -j <min joint freq> ignore the pairs with a lower joint frequency.\n";
+  out << "     -i <min PMI> ignore the pairs with a lower PMI (column 11 of the pairs file).\n";
+  out << "     -R truncation report (with -k, -j or -i): the full pairs data is also kept in\n";
+  out << "        memory and every unique ambiguity case is also processed with it; the decisions\n";
+  out << "        which change are counted in the '.stats' file and a summary line for every\n";
+  out << "        combination of parameters is appended to '<output dir>.truncation.tsv'.\n";
+  out << "     -C compact pairs data: the co-occurrence rows are stored sorted, delta-encoded\n";
+  out << "        and bit-packed (see packed-rows.h) instead of hash maps, which takes a\n";
+  out << "        fraction of the memory. The decisions are the same; the NB probabilities can\n";
+  out << "        differ in the last digits (the features are in a different order), see -X.\n";
+  out << "        With -X or -R the pairs data is also loaded as hash maps, for the legacy\n";
+  out << "        functions and as the full data. Cannot be used with several values for -k.\n";
+  out << "     -H <placement> placement of the compact pairs data (option -C) in memory:\n";
+  out << "        'huge' huge pages (1 GB or 2 MB pages if reserved, otherwise transparent\n";
+  out << "        huge pages); 'interleave' huge pages interleaved over the NUMA nodes;\n";
+  out << "        'replicate[:<percent>]' huge pages, the rows of the most frequent CUIs (up to\n";
+  out << "        <percent> of the entries, default 25) copied on every NUMA node and the other\n";
+  out << "        rows interleaved. With 'interleave' and 'replicate' the worker threads (option\n";
+  out << "        -t) are pinned to the nodes in turn, and use the copy of their node (a\n";
+  out << "        single thread is pinned to the first node with 'replicate'). The output is\n";
+  out << "        identical.\n";
+  out << "     -U <decision store file> reuse the decisions of the documents already processed\n";
+  out << "        by a previous run: the decisions for a document are reused if the PMID, the\n";
+  out << "        content (CUIs rows), the parameters and the pairs data and resources are the\n";
+  out << "        same, e.g. for the abstracts contained in two corpora. The decisions of the\n";
+  out << "        other documents are appended to the file. The output is identical; the\n";
+  out << "        reuse rate is given in the '.stats' file. Cannot be used with -R or -X.\n";
+  out << "     -T <seconds> write the instrumentation file '<output dir>.stats.json' every\n";
+  out << "        <seconds> during processing (by default it is written only after every\n";
+  out << "        input file, together with the '.stats' file).\n";
+  out << "     -D <non-latest pmid versions file> deduplicate the input on the fly: rows for\n";
+  out << "        which <pmid>.<version> is listed in the file (output of\n";
+  out << "        'extract-non-latest-pmid-versions.pl') are discarded and the version suffix\n";
+  out << "        is removed from the other PMIDs, like 'discard-non-latest-pmid-versions.pl'.\n";
+  out << "        Use only with the original KD abstracts data.\n";
   out << "\n";
 }
 
@@ -85,6 +353,42 @@ string strProp(INT nb, INT total) {
   return string(buff);
 }
 
+double nowSeconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+
+void addScoringTime(double seconds, BatchCounters &c) {
+  c.scoring += seconds;
+  int bucket = 0;
+  double upTo = 1e-6;
+  while ((bucket < nbScoringTimeBuckets-1) && (seconds >= upTo)) {
+    bucket++;
+    upTo *= 2;
+  }
+  c.scoringTimeHistogram[bucket]++;
+}
+
+
+void resetTimingCase() {
+  timing.processingStart = nowSeconds();
+  timing.lastJsonDump = timing.processingStart;
+  timing.files = 0;
+  timing.rows = 0;
+  timing.docs = 0;
+  timing.features = 0;
+  timing.scoring = 0;
+  timing.writing = 0;
+  timing.inputWait = 0;
+  timing.outputWait = 0;
+  for (int i=0; i<nbScoringTimeBuckets; i++) {
+    timing.scoringTimeHistogram[i] = 0;
+  }
+}
+
+
 void resetStatsCase() {
   totalCases = 0;
   totalAmbig = 0;
@@ -95,6 +399,107 @@ void resetStatsCase() {
   uniqueUnknownTarget = 0;
   uniqueMethodNA = 0;
   uniqueThrehsholdReject = 0;
+  totalDiscardedNonLatestVersion = 0;
+  equivalenceChecked = 0;
+  equivalenceMismatches = 0;
+  equivalenceExplained = 0;
+  for (int i=0; i<4; i++) {
+    for (int j=0; j<4; j++) {
+      truncationTransitions[i][j] = 0;
+    }
+  }
+  truncationOtherCui = 0;
+  decisionStoreLookups = 0;
+  decisionStoreReused = 0;
+  decisionStoreReusedCases = 0;
+  for (unordered_map<string, TargetGroup> &cache : targetGroupsCaches) {
+    cache.clear();
+  }
+  groupProfiles.clear();
+  resetTimingCase();
+}
+
+
+double perSec(INT nb, double seconds) {
+  return (seconds > 0) ? (double) nb / seconds : 0;
+}
+
+
+// JSON string literal: quotes, backslashes and control characters escaped
+string jsonString(const string &s) {
+  string res = "\"";
+  for (char c : s) {
+    if ((c == '"') || (c == '\\')) {
+      res += '\\';
+      res += c;
+    } else if ((unsigned char) c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char) c);
+      res += buf;
+    } else {
+      res += c;
+    }
+  }
+  return res + "\"";
+}
+
+
+// machine-readable counterpart of the '.stats' file, with the timing information
+void writeStatsJson(string filename, string &method, int minConceptFreq, double minPosteriorProb, string currentFile) {
+
+  ofstream outFH(filename);
+  if (!outFH) {
+    cerr << "Error opening "<< filename << endl;
+    exit(1);
+  }
+  double total = nowSeconds() - timing.processingStart;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  outFH << fixed;
+  outFH << "{\n";
+  outFH << "  \"method\": " << jsonString(method) << ",\n";
+  outFH << "  \"minConceptFreq\": " << minConceptFreq << ",\n";
+  outFH << "  \"minPosteriorProb\": " << minPosteriorProb << ",\n";
+  outFH << "  \"inProgress\": " << ((currentFile.length()>0) ? "true" : "false") << ",\n";
+  outFH << "  \"currentFile\": " << jsonString(currentFile) << ",\n";
+  outFH << "  \"loadSeconds\": { \"refFile\": " << timing.loadRefFile << ", \"external\": " << timing.loadExternal;
+  outFH << ", \"nonLatest\": " << timing.loadNonLatest << ", \"pairs\": " << timing.loadPairs << " },\n";
+  outFH << "  \"files\": " << timing.files << ",\n";
+  outFH << "  \"rows\": " << timing.rows << ",\n";
+  outFH << "  \"documents\": " << timing.docs << ",\n";
+  outFH << "  \"uniqueAmbiguityCases\": " << uniqueTotalCases << ",\n";
+  outFH << "  \"decisionStore\": { \"documents\": " << decisionStoreLookups << ", \"reused\": " << decisionStoreReused << ", \"reusedCases\": " << decisionStoreReusedCases << " },\n";
+  outFH << "  \"processingSeconds\": { \"total\": " << total << ", \"features\": " << timing.features;
+  outFH << ", \"scoring\": " << timing.scoring << ", \"writing\": " << timing.writing;
+  outFH << ", \"readingOther\": " << (total - timing.features - timing.scoring - timing.writing);
+  outFH << ", \"inputWait\": " << timing.inputWait << ", \"outputWait\": " << timing.outputWait << " },\n";
+  outFH << "  \"rowsPerSecond\": " << perSec(timing.rows, total) << ",\n";
+  outFH << "  \"documentsPerSecond\": " << perSec(timing.docs, total) << ",\n";
+  outFH << "  \"nbKernel\": \"" << nbKernel.name << "\",\n";
+  outFH << "  \"uniqueAmbiguityCasesPerScoringSecond\": { " << jsonString(method) << ": " << perSec(uniqueTotalCases, timing.scoring) << " },\n";
+  outFH << "  \"scoringCallMicrosecondsHistogram\": [";
+  double upTo = 1;
+  for (int i=0; i<nbScoringTimeBuckets; i++) {
+    outFH << ((i>0) ? ", " : " ") << "{ \"lessThan\": ";
+    if (i < nbScoringTimeBuckets-1) {
+      outFH << (INT) upTo;
+    } else {
+      outFH << "null";
+    }
+    outFH << ", \"calls\": " << timing.scoringTimeHistogram[i] << " }";
+    upTo *= 2;
+  }
+  outFH << " ],\n";
+  outFH << "  \"memoryBytes\": { \"uniFreq\": " << memory.uniFreq << ", \"jointFreqIndex\": " << memory.jointFreqIndex;
+  outFH << ", \"jointFreqRows\": " << memory.jointFreqRows << ", \"idToCui\": " << memory.idToCui;
+  outFH << ", \"cuiDictionary\": " << memory.cuiDictionary << ", \"external\": " << memory.external;
+  outFH << ", \"nonLatest\": " << memory.nonLatest << ", \"targetGroupsCache\": " << memory.targetGroupsCache;
+  outFH << ", \"decisionStore\": " << memory.decisionStore << ", \"perDocPeak\": " << memory.perDocPeak << " },\n";
+  outFH << "  \"peakRSSKB\": " << usage.ru_maxrss << "\n";
+  outFH << "}\n";
+  outFH.close();
+  timing.lastJsonDump = nowSeconds();
+
 }
 
 
@@ -139,37 +544,62 @@ string join(vector<string> v, string sep) {
 }
 
 
-void jointMapAdd(unordered_map<string, unordered_map<string, INT>*> *jointFreq, string &cui1, string &cui2, INT jointFreqVal) {
+// the fingerprints of the decision store (option -U) must be stable across runs, see fnv1a() in pairs-store.h
+uint64_t fnv1a(const string &s, uint64_t h = FNV1A_OFFSET_BASIS) {
+  return fnv1a(s.data(), s.length(), h);
+}
 
+string hex64(uint64_t v) {
+  char buff[17];
+  sprintf(buff, "%016lx", (unsigned long) v);
+  return string(buff);
+}
 
-  unordered_map<string, unordered_map<string, INT>*>::iterator it = jointFreq->find(cui1);
-  unordered_map<string, INT> *submap;
-  if (it != jointFreq->end()) {
-    submap = it->second;
-  } else {
-    submap = new unordered_map<string, INT>();
-    jointFreq->insert({cui1, submap});
+
+uint32_t internCui(const string &cui) {
+  unordered_map<string, uint32_t>::iterator it = cuiIdByName.find(cui);
+  if (it != cuiIdByName.end()) {
+    return it->second;
   }
-  submap->insert({ cui2, jointFreqVal });
+  uint32_t id = cuiNames.size();
+  cuiNames.push_back(cui);
+  cuiIdByName.insert({cui, id});
+  return id;
+}
 
+
+// parses a PMID made only of digits, returns 0 if the format is not valid
+int parsePmid(const char *s, size_t length, uint32_t *pmid) {
+  if ((length == 0) || (length > 10)) {
+    return 0;
+  }
+  uint64_t v = 0;
+  for (size_t i=0; i<length; i++) {
+    if ((s[i] < '0') || (s[i] > '9')) {
+      return 0;
+    }
+    v = v * 10 + (s[i] - '0');
+  }
+  if (v > UINT32_MAX) {
+    return 0;
+  }
+  *pmid = v;
+  return 1;
 }
 
 
-unordered_map<INT, string> *readCuiRefFile(string filename) {
+// idToCui[id] is the CUI (in the CUIs dictionary) for the term id, i.e. the line number
+vector<uint32_t> *readCuiRefFile(string filename) {
 
-  unordered_map<INT, string> *m = new unordered_map<INT, string>();
+  vector<uint32_t> *m = new vector<uint32_t>();
   ifstream file(filename);
   if (!file) {
     cerr << "Error opening "<< filename << endl;
     exit(1);
   }
-  INT id=0;
   string str; 
   while (getline(file, str)) {
-    vector<string> cols = split(str,'\t');
-    string cui = cols[0];
-    m->insert({id, cui});
-    id++;
+    m->push_back(internCui(str.substr(0, str.find('\t'))));
   }
   file.close();
   return m;
@@ -178,9 +608,36 @@ unordered_map<INT, string> *readCuiRefFile(string filename) {
 
 
 
-unordered_map<string, vector<string>> *readExternalResource(string &filename, int colPMIDNo, int colCuisNo, char separator) {
+// reads the output of 'extract-non-latest-pmid-versions.pl': <pmid> <version>
+// the set contains '<pmid>.<version>', i.e. the same format as the first column in the KD abstracts data
+unordered_set<string> *readNonLatestPmidVersions(string filename) {
+
+  unordered_set<string> *s = new unordered_set<string>();
+  ifstream file(filename);
+  if (!file) {
+    cerr << "Error opening "<< filename << endl;
+    exit(1);
+  }
+  string str; 
+  int lineNo=1;
+  while (getline(file, str)) {
+    vector<string> cols = split(str,'\t');
+    if (cols.size()<2) {
+      cerr << "Format error in '"<<filename<<"' line "<<lineNo<<": expecting <pmid> <version>" <<endl;
+      exit(5);
+    }
+    s->insert(cols[0]+"."+cols[1]);
+    lineNo++;
+  }
+  file.close();
+  return s;
+
+}
+
+
+
+ExternalResource *readExternalResource(string &filename, int colPMIDNo, int colCuisNo, char separator) {
 
-  unordered_map<string, vector<string>> *m = new unordered_map<string, vector<string>>();
   colPMIDNo--;
   colCuisNo--;
   ifstream file(filename);
@@ -188,75 +645,892 @@ unordered_map<string, vector<string>> *readExternalResource(string &filename, in
     cerr << "Error opening "<< filename << endl;
     exit(1);
   }
+  vector<uint32_t> pmidByLine;
+  vector<uint32_t> cuisStartByLine;
+  vector<uint32_t> cuiIdsByLine;
   string str; 
   int lineNo=1;
+  INT invalidPmid = 0;
   while (getline(file, str)) {
     vector<string> cols = split(str,'\t');
     if ((cols.size()<=colPMIDNo) || (cols.size()<=colCuisNo)) {
       cerr << "Format error in '"<<filename<<"' line "<<lineNo<<": not enough columns" <<endl;
       exit(5);
     }
-    string &pmid = cols[colPMIDNo];
-    string &cuisStr= cols[colCuisNo];
-    vector<string> cuis = split(cuisStr, separator);
-    m->insert({pmid, cuis});
+    string &pmidStr = cols[colPMIDNo];
+    uint32_t pmid;
+    if (parsePmid(pmidStr.c_str(), pmidStr.length(), &pmid)) {
+      pmidByLine.push_back(pmid);
+      cuisStartByLine.push_back(cuiIdsByLine.size());
+      for (string &cui : split(cols[colCuisNo], separator)) {
+	if (cui.length()>0) {
+	  cuiIdsByLine.push_back(internCui(cui));
+	}
+      }
+    } else {
+      invalidPmid++;
+    }
     lineNo++;
   }
+  cuisStartByLine.push_back(cuiIdsByLine.size());
   file.close();
-  return m;
+  if (invalidPmid>0) {
+    cerr << "Warning: "<<invalidPmid<<" lines ignored in '"<<filename<<"' due to invalid PMID"<<endl;
+  }
+  if (cuiIdsByLine.size() > UINT32_MAX) {
+    cerr << "Error: too many CUIs in '"<<filename<<"'"<<endl;
+    exit(5);
+  }
+
+  // sort by PMID; if a PMID appears several times only the first occurrence is kept
+  vector<uint32_t> order(pmidByLine.size());
+  for (uint32_t i=0; i<order.size(); i++) {
+    order[i] = i;
+  }
+  stable_sort(order.begin(), order.end(), [&pmidByLine](uint32_t a, uint32_t b) { return pmidByLine[a] < pmidByLine[b]; });
+  ExternalResource *r = new ExternalResource();
+  for (uint32_t i=0; i<order.size(); i++) {
+    uint32_t line = order[i];
+    if ((r->pmids.size()==0) || (r->pmids.back() != pmidByLine[line])) {
+      r->pmids.push_back(pmidByLine[line]);
+      r->cuisStart.push_back(r->cuiIds.size());
+      r->cuiIds.insert(r->cuiIds.end(), cuiIdsByLine.begin()+cuisStartByLine[line], cuiIdsByLine.begin()+cuisStartByLine[line+1]);
+    }
+  }
+  r->cuisStart.push_back(r->cuiIds.size());
+  return r;
 
 }
 
 
+template <typename T>
+void writeVector(FILE *f, vector<T> &v) {
+  uint64_t n = v.size();
+  fwrite(&n, sizeof(n), 1, f);
+  fwrite(v.data(), sizeof(T), n, f);
+}
 
-void readPairsData(string filename, unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq, int minFreq) {
 
+template <typename T>
+int readVector(FILE *f, vector<T> &v) {
+  uint64_t n;
+  if (fread(&n, sizeof(n), 1, f) != 1) {
+    return 0;
+  }
+  v.resize(n);
+  return (fread(v.data(), sizeof(T), n, f) == n);
+}
 
-  ifstream file(filename);
+
+// identifies the resource read with -e: '<path> <size> <mtime> <col PMID> <col CUIs> <separator>'
+string externalResourceSource(string &filename, int colPMIDNo, int colCuisNo, char separator) {
+  char path[PATH_MAX];
+  struct stat sb;
+  string s = (realpath(filename.c_str(), path) != NULL) ? string(path) : filename;
+  if (stat(filename.c_str(), &sb) == 0) {
+    s += "\t"+to_string((long long) sb.st_size)+"\t"+to_string((long long) sb.st_mtime);
+  }
+  return s+"\t"+to_string(colPMIDNo)+"\t"+to_string(colCuisNo)+"\t"+string(1, separator);
+}
+
+
+/*
+ * The snapshot contains the CUIs strings, since the dictionary ids depend on the loading order,
+ * and the source of the resource (see externalResourceSource). It is written to '<filename>.tmp'
+ * then renamed, so that an interrupted run leaves no partial snapshot.
+ */
+void writeExternalResourceSnapshot(string filename, ExternalResource *r, string source) {
+
+  string tmpFile = filename+".tmp";
+  FILE *f = fopen(tmpFile.c_str(), "wb");
+  if (f == NULL) {
+    cerr << "Error opening "<< tmpFile << endl;
+    exit(1);
+  }
+  unordered_map<uint32_t, uint32_t> localIdByCuiId;
+  vector<uint32_t> localIds(r->cuiIds.size());
+  vector<char> namesPool;
+  for (size_t i=0; i<r->cuiIds.size(); i++) {
+    unordered_map<uint32_t, uint32_t>::iterator it = localIdByCuiId.find(r->cuiIds[i]);
+    if (it == localIdByCuiId.end()) {
+      it = localIdByCuiId.insert({r->cuiIds[i], localIdByCuiId.size()}).first;
+      string &name = cuiNames[r->cuiIds[i]];
+      namesPool.insert(namesPool.end(), name.begin(), name.end());
+      namesPool.push_back('\0');
+    }
+    localIds[i] = it->second;
+  }
+  vector<char> sourceChars(source.begin(), source.end());
+  fwrite(externalSnapshotMagic, sizeof(externalSnapshotMagic), 1, f);
+  writeVector(f, sourceChars);
+  writeVector(f, r->pmids);
+  writeVector(f, r->cuisStart);
+  writeVector(f, localIds);
+  writeVector(f, namesPool);
+  if ((fclose(f) != 0) || (rename(tmpFile.c_str(), filename.c_str()) != 0)) {
+    cerr << "Error writing "<< filename << endl;
+    exit(1);
+  }
+
+}
+
+
+// the snapshot must not be corrupt: the CUIs ranges are used without checks
+int validExternalResource(ExternalResource *r) {
+  if ((r->cuisStart.size() != r->pmids.size()+1) || (r->cuisStart[0] != 0) || (r->cuisStart.back() != r->cuiIds.size())) {
+    return 0;
+  }
+  for (size_t i=0; i<r->pmids.size(); i++) {
+    if ((r->cuisStart[i] > r->cuisStart[i+1]) || ((i>0) && (r->pmids[i-1] >= r->pmids[i]))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+ * Returns NULL if the file does not exist, or if 'source' is not empty and the snapshot has an
+ * older format or was built from another source (then the resource must be read again).
+ */
+ExternalResource *readExternalResourceSnapshot(string filename, string source) {
+
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  ExternalResource *r = new ExternalResource();
+  char magic[sizeof(externalSnapshotMagic)];
+  vector<char> sourceChars;
+  vector<char> namesPool;
+  int magicOk = (fread(magic, sizeof(magic), 1, f) == 1) && (memcmp(magic, externalSnapshotMagic, sizeof(magic)-1) == 0);
+  if (magicOk && (magic[sizeof(magic)-1] != externalSnapshotMagic[sizeof(magic)-1]) && (source.length()>0)) {
+    cerr << "Snapshot file '"<<filename<<"' has an older format, rebuilding it"<< endl;
+    fclose(f);
+    delete r;
+    return NULL;
+  }
+  if (!magicOk || (magic[sizeof(magic)-1] != externalSnapshotMagic[sizeof(magic)-1]) || !readVector(f, sourceChars)) {
+    cerr << "Error: invalid snapshot file '"<<filename<<"'"<< endl;
+    exit(5);
+  }
+  if ((source.length()>0) && (string(sourceChars.begin(), sourceChars.end()) != source)) {
+    cerr << "Snapshot file '"<<filename<<"' was built from another file or with other options, rebuilding it"<< endl;
+    fclose(f);
+    delete r;
+    return NULL;
+  }
+  if (!readVector(f, r->pmids) || !readVector(f, r->cuisStart) || !readVector(f, r->cuiIds) || !readVector(f, namesPool) ||
+      !validExternalResource(r) || (namesPool.size()>0 && namesPool.back() != '\0')) {
+    cerr << "Error: invalid snapshot file '"<<filename<<"'"<< endl;
+    exit(5);
+  }
+  fclose(f);
+  vector<uint32_t> cuiIdByLocalId;
+  for (size_t pos=0; pos<namesPool.size(); pos += strlen(&namesPool[pos]) + 1) {
+    cuiIdByLocalId.push_back(internCui(string(&namesPool[pos])));
+  }
+  for (uint32_t &id : r->cuiIds) {
+    if (id >= cuiIdByLocalId.size()) {
+      cerr << "Error: invalid snapshot file '"<<filename<<"'"<< endl;
+      exit(5);
+    }
+    id = cuiIdByLocalId[id];
+  }
+  return r;
+
+}
+
+
+
+// options of the pairs data loaders (pairs-store.h) from the command line
+PairsStoreOptions pairsStoreOptions(int minFreq, INT topK, int compact) {
+  PairsStoreOptions o;
+  initPairsStoreOptions(o);
+  o.compact = compact;
+  o.minFreq = minFreq;
+  o.minJointFreq = minJointFreq;
+  o.minPMI = minPMI;
+  o.topK = topK;
+  if (decisionStoreFile.length()>0) {
+    o.fingerprint = &pairsDataFingerprint;
+  }
+  o.progress = 1;
+  return o;
+}
+
+
+// the entries of the hash maps and of the compact rows if not NULL
+INT countJointFreqEntries(unordered_map<string, unordered_map<string, INT>*> *jointFreq, PackedRows *packed) {
+  INT n = 0;
+  if (packed != NULL) {
+    for (size_t row=0; row<packedRowsNb(*packed); row++) {
+      n += packedRowLength(*packed, row);
+    }
+  }
+  for (unordered_map<string, unordered_map<string, INT>*>::iterator it = jointFreq->begin(); it != jointFreq->end(); it++) {
+    n += it->second->size();
+  }
+  return n;
+}
+
+
+
+/*
+ * Memory accounting
+ *
+ * The sizes are computed from the layout of the structures with the GNU libstdc++ and glibc:
+ * a hash map is an array of buckets (one pointer each) plus one heap block by element
+ * containing the next pointer, the pair and the cached hash code; strings longer than 15
+ * characters use an additional heap block. This is an approximation (e.g. fragmentation
+ * is ignored) but it is sufficient to compare with the peak RSS.
+ */
+
+// size of the heap block used by malloc for a request of n bytes
+size_t mallocBytes(size_t n) {
+  size_t b = (n + sizeof(size_t) + 15) & ~((size_t) 15);
+  return (b < 32) ? 32 : b;
+}
+
+size_t heapBytes(const string &s) {
+  return (s.capacity() > 15) ? mallocBytes(s.capacity()+1) : 0;
+}
+
+size_t heapBytes(INT /*v*/) {
+  return 0;
+}
+
+size_t heapBytes(uint32_t /*v*/) {
+  return 0;
+}
+
+size_t heapBytes(TargetGroup * /*g*/) { // not owned
+  return 0;
+}
+
+size_t heapBytes(const vector<string> &v) {
+  size_t bytes = (v.capacity()>0) ? mallocBytes(v.capacity()*sizeof(string)) : 0;
+  for (const string &s : v) {
+    bytes += heapBytes(s);
+  }
+  return bytes;
+}
+
+size_t heapBytes(const TargetGroup &g) {
+  return heapBytes(g.cuis) + heapBytes(g.sortedCuisStr);
+}
+
+template <typename T, typename A>
+size_t heapBytes(const vector<T, A> &v) {
+  return (v.capacity()>0) ? mallocBytes(v.capacity()*sizeof(T)) : 0;
+}
+
+template <typename K, typename V>
+size_t hashMapBytes(const unordered_map<K, V> &m) {
+  size_t bytes = (m.bucket_count()>1) ? mallocBytes(m.bucket_count()*sizeof(void *)) : 0;
+  bytes += m.size() * mallocBytes(sizeof(void *) + sizeof(typename unordered_map<K, V>::value_type) + sizeof(size_t));
+  for (typename unordered_map<K, V>::const_iterator it = m.begin(); it != m.end(); it++) {
+    bytes += heapBytes(it->first) + heapBytes(it->second);
+  }
+  return bytes;
+}
+
+template <typename K>
+size_t hashSetBytes(const unordered_set<K> &m) {
+  size_t bytes = (m.bucket_count()>1) ? mallocBytes(m.bucket_count()*sizeof(void *)) : 0;
+  bytes += m.size() * mallocBytes(sizeof(void *) + sizeof(K) + sizeof(size_t));
+  for (typename unordered_set<K>::const_iterator it = m.begin(); it != m.end(); it++) {
+    bytes += heapBytes(*it);
+  }
+  return bytes;
+}
+
+
+// accounts the loaded resources, called once after loading
+void accountLoadedResources(unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq, vector<uint32_t> *idToCui, ExternalResource *externalCuisByPMid, unordered_set<string> *nonLatestPmidVersions) {
+
+  memory.uniFreq = hashMapBytes(*uniFreq);
+  memory.jointFreqIndex = (jointFreq->bucket_count()>1) ? mallocBytes(jointFreq->bucket_count()*sizeof(void *)) : 0;
+  memory.jointFreqIndex += jointFreq->size() * mallocBytes(sizeof(void *) + sizeof(unordered_map<string, unordered_map<string, INT>*>::value_type) + sizeof(size_t));
+  memory.jointFreqRows = 0;
+  for (unordered_map<string, unordered_map<string, INT>*>::iterator it = jointFreq->begin(); it != jointFreq->end(); it++) {
+    memory.jointFreqIndex += heapBytes(it->first);
+    memory.jointFreqRows += mallocBytes(sizeof(unordered_map<string, INT>)) + hashMapBytes(*it->second);
+  }
+  if (packedJointFreq != NULL) {
+    vector<const PackedRows *> rows(packedReplicas.begin(), packedReplicas.end());
+    rows.push_back(packedReplicas.empty() ? packedJointFreq : packedJointFreq->shared);
+    for (const PackedRows *replica : rows) {
+      const PackedRows &p = *replica;
+      memory.jointFreqIndex += heapBytes(p.rowFirstBlock) + heapBytes(p.rowLength) + heapBytes(p.blockFirstId) + heapBytes(p.blockOffset);
+      memory.jointFreqRows += heapBytes(p.data);
+    }
+  }
+  memory.idToCui = (idToCui != NULL) ? heapBytes(*idToCui) : 0;
+  memory.cuiDictionary = heapBytes(cuiNames) + hashMapBytes(cuiIdByName) + heapBytes(pairsCuiNames) + hashMapBytes(pairsCuiIdByName) + heapBytes(pairsUniFreqById);
+  memory.external = 0;
+  if (externalCuisByPMid != NULL) {
+    memory.external = heapBytes(externalCuisByPMid->pmids) + heapBytes(externalCuisByPMid->cuisStart) + heapBytes(externalCuisByPMid->cuiIds);
+  }
+  memory.nonLatest = (nonLatestPmidVersions != NULL) ? hashSetBytes(*nonLatestPmidVersions) : 0;
+  memory.decisionStore = hashMapBytes(storedDecisions);
+
+}
+
+
+void accountTargetGroupsCache() {
+  memory.targetGroupsCache = 0;
+  for (unordered_map<string, TargetGroup> &cache : targetGroupsCaches) {
+    memory.targetGroupsCache += hashMapBytes(cache);
+  }
+}
+
+
+string strMB(size_t bytes) {
+  char buff[100];
+  sprintf(buff, "%.1f MB", (double) bytes / 1048576.0);
+  return string(buff);
+}
+
+
+void printMemoryBreakdown(ostream &out) {
+  size_t total = memory.uniFreq + memory.jointFreqIndex + memory.jointFreqRows + memory.idToCui + memory.cuiDictionary + memory.external + memory.nonLatest + memory.targetGroupsCache + memory.decisionStore + memory.perDocPeak;
+  out << "  uniFreq: "<<memory.uniFreq<<" ("<<strMB(memory.uniFreq)<<")\n";
+  out << "  jointFreq index: "<<memory.jointFreqIndex<<" ("<<strMB(memory.jointFreqIndex)<<")\n";
+  out << "  jointFreq rows: "<<memory.jointFreqRows<<" ("<<strMB(memory.jointFreqRows)<<")\n";
+  out << "  idToCui: "<<memory.idToCui<<" ("<<strMB(memory.idToCui)<<")\n";
+  out << "  CUIs dictionary: "<<memory.cuiDictionary<<" ("<<strMB(memory.cuiDictionary)<<")\n";
+  out << "  external resource: "<<memory.external<<" ("<<strMB(memory.external)<<")\n";
+  out << "  non-latest PMID versions: "<<memory.nonLatest<<" ("<<strMB(memory.nonLatest)<<")\n";
+  out << "  target groups cache: "<<memory.targetGroupsCache<<" ("<<strMB(memory.targetGroupsCache)<<")\n";
+  out << "  decision store: "<<memory.decisionStore<<" ("<<strMB(memory.decisionStore)<<")\n";
+  out << "  per-document state (peak for a batch): "<<memory.perDocPeak<<" ("<<strMB(memory.perDocPeak)<<")\n";
+  out << "  Total: "<<total<<" ("<<strMB(total)<<")\n";
+}
+
+
+void printPlacement(ostream &out) {
+  MemoryPlacement total = makeMemoryPlacement(PLACEMENT_NUMA_DEFAULT, 0);
+  for (MemoryPlacement *p : placements) {
+    total.bytes1G += p->bytes1G;
+    total.bytes2M += p->bytes2M;
+    total.bytesTransparent += p->bytesTransparent;
+    total.bytesNumaFailed += p->bytesNumaFailed;
+  }
+  out << "1 GB pages: "<<strMB(total.bytes1G)<<", 2 MB pages: "<<strMB(total.bytes2M)<<", transparent huge pages (requested): "<<strMB(total.bytesTransparent);
+  if (total.bytesNumaFailed > 0) {
+    out << ", NUMA policy failed: "<<strMB(total.bytesNumaFailed);
+  }
+  out << "\n";
+  if (!packedReplicas.empty()) {
+    PackedRows &replica = *packedReplicas[0];
+    INT hotEntries = 0;
+    INT entries = 0;
+    for (size_t row=0; row<packedRowsNb(replica); row++) {
+      entries += packedRowLength(replica, row);
+      if (row < replica.rowLength.size()) {
+	hotEntries += replica.rowLength[row];
+      }
+    }
+    out << "  Rows replicated on every node: "<<replica.rowLength.size()<<" / "<<packedRowsNb(replica)<<" (";
+    out << strProp(hotEntries, entries)<<" % of the entries), "<<strMB(packedRowsBytes(replica))<<" by node\n";
+  }
+}
+
+
+/*
+ * Option -H: placement of the compact rows, set before they are built (see readPairsDataPacked):
+ * huge pages, interleaved over the NUMA nodes, or with 'replicate' the rows of the most frequent
+ * CUIs copied on every node and the other rows interleaved.
+ */
+void setPairsPlacement(string &mode, PairsStoreOptions &o) {
+
+  numaNodesList = numaNodes();
+  int nbNodes = numaNodesList.size();
+  unsigned long allNodes = 0;
+  for (NumaNode &node : numaNodesList) {
+    allNodes |= 1UL << node.id;
+  }
+  int policy = ((mode != "huge") && (nbNodes > 1)) ? PLACEMENT_NUMA_INTERLEAVE : PLACEMENT_NUMA_DEFAULT;
+  placements.push_back(new MemoryPlacement(makeMemoryPlacement(policy, allNodes)));
+  o.placement = placements.back();
+  if ((mode == "replicate") && (nbNodes > 1)) {
+    for (NumaNode &node : numaNodesList) {
+      placements.push_back(new MemoryPlacement(makeMemoryPlacement(PLACEMENT_NUMA_BIND, 1UL << node.id)));
+      o.replicaPlacements.push_back(placements.back());
+    }
+    o.replicatedEntries = replicatedPercent / 100;
+  }
+  pinWorkers = (mode != "huge") && (nbNodes > 1);
+
+}
+
+
+
+/*
+ * Memory estimate (option -S)
+ *
+ * The files are sorted (e.g. the pairs file by C1), so the lines must be sampled uniformly: the
+ * whole file is read but only one line out of 1/<rate> is given to processLine (the other lines
+ * are skipped without being copied or split, which is what takes time when loading).
+ * Returns the number of lines in the file (excluding the header if any) and sets coverage to
+ * the proportion of the lines actually processed.
+ */
+double sampleLines(string &filename, double rate, int header, function<void(string &)> processLine, double *coverage) {
+
+  ifstream file(filename, ios::binary);
   if (!file) {
     cerr << "Error opening "<< filename << endl;
     exit(1);
   }
+  string str;
+  if (header) {
+    file.ignore(numeric_limits<streamsize>::max(), '\n');
+  }
+  INT lines = 0;
+  INT sampledLines = 0;
+  while (file.peek() != EOF) {
+    if ((rate >= 1) || (floor(lines * rate) != floor((lines-1) * rate))) { // the first line is always processed
+      getline(file, str);
+      sampledLines++;
+      processLine(str);
+    } else {
+      file.ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+    lines++;
+  }
+  *coverage = (lines > 0) ? (double) sampledLines / (double) lines : 1;
+  return lines;
 
-  
-  string str; 
-  getline(file, str); // skip header
-  INT lineNo=1;
+}
 
-  while (getline(file, str)) {
 
-    if (lineNo % 8192 == 0) {
-      fprintf(stderr,"\r%ld",lineNo);
+/*
+ * Estimated number of distinct values in the whole population given the number of occurrences
+ * of every value in the sample (Chao1 estimator, bias-corrected), at most the estimated total
+ * number of occurrences. Exact if the sample is the whole population.
+ */
+double estimateDistinct(unordered_map<string, INT> &occurrences, double coverage) {
+  if (coverage >= 1) {
+    return occurrences.size();
+  }
+  double f1 = 0;
+  double f2 = 0;
+  double total = 0;
+  for (unordered_map<string, INT>::iterator it = occurrences.begin(); it != occurrences.end(); it++) {
+    if (it->second == 1) {
+      f1++;
+    } else if (it->second == 2) {
+      f2++;
     }
+    total += it->second;
+  }
+  return min((double) occurrences.size() + f1 * (f1 - 1) / (2 * (f2 + 1)), total / coverage);
+}
 
-    vector<string> cols = split(str,'\t');
 
-    string cui1 = cols[0];
-    string cui2 = cols[1];
-    INT freqC1 = strtol(cols[2].c_str(), NULL,10);
-    INT freqC2 = strtol(cols[3].c_str(), NULL,10);
+// estimated bytes of a hash map with n elements of size elemBytes: the number of buckets is between n and 2n
+size_t estimateHashMapBytes(double n, size_t elemBytes) {
+  if (n < 1) {
+    return 0;
+  }
+  return mallocBytes((size_t) (1.5 * n) * sizeof(void *)) + (size_t) n * mallocBytes(sizeof(void *) + elemBytes + sizeof(size_t));
+}
+
 
-    if ((freqC1 >= minFreq) && (freqC2 >= minFreq)) {
-      INT jointFreqVal = strtol(cols[6].c_str(), NULL,10);
-      uniFreq->insert({ cui1, freqC1 });
-      uniFreq->insert({ cui2, freqC2 });
-      jointMapAdd(jointFreq, cui1, cui2, jointFreqVal);
-      jointMapAdd(jointFreq, cui2, cui1, jointFreqVal);
+/*
+ * Estimated bytes of the compact rows (see packed-rows.h) for the non-empty rows of the given
+ * lengths over nbIds ids. The width of a count is the average width of the largest of PACKED_BLOCK_SIZE
+ * sampled counts (consecutive in the file, i.e. mostly from the same row); the ids of a row are
+ * assumed evenly spread, the largest gap of a block being about 5 times the average one.
+ */
+void estimatePackedBytes(vector<double> &rowLengths, double nbIds, vector<INT> &sampledCounts, size_t *indexBytes, size_t *dataBytes) {
+
+  double countBits = 0;
+  double nbCountBlocks = 0;
+  for (size_t start=0; start<sampledCounts.size(); start+=PACKED_BLOCK_SIZE) {
+    INT maxCount = 0;
+    for (size_t i=start; (i<start+PACKED_BLOCK_SIZE) && (i<sampledCounts.size()); i++) {
+      maxCount = max(maxCount, sampledCounts[i]);
     }
-    lineNo++;
+    countBits += packedBitsFor(maxCount);
+    nbCountBlocks++;
   }
-  file.close();
-  cerr<<endl;
+  countBits = (nbCountBlocks > 0) ? countBits / nbCountBlocks : 0;
+  double blocks = 0;
+  double dataBits = 0;
+  for (double length : rowLengths) {
+    if (length < 1) {
+      continue;
+    }
+    double rowBlocks = ceil(length / PACKED_BLOCK_SIZE);
+    int deltaBits = packedBitsFor((uint64_t) (5 * nbIds / length));
+    blocks += rowBlocks;
+    dataBits += rowBlocks * (3 * 8 + 4) + (length - rowBlocks) * deltaBits + length * countBits; // header, last byte half used
+  }
+  // every id of the dictionary has a row, possibly empty
+  *indexBytes = mallocBytes((size_t) (nbIds+1) * sizeof(uint64_t)) + mallocBytes((size_t) nbIds * sizeof(uint32_t));
+  *indexBytes += mallocBytes((size_t) blocks * sizeof(uint32_t)) + mallocBytes((size_t) blocks * sizeof(uint64_t));
+  *dataBytes = mallocBytes((size_t) (dataBits / 8) + sizeof(uint64_t));
 
 }
 
 
+/*
+ * Estimates the memory used by the resources which would be loaded with the same options,
+ * prints the result to STDOUT. The pairs data is estimated after the floors (-j, -i) and the
+ * truncation to the first value of -k, in the format of option -C if given.
+ */
+void estimateMemory(double rate, string pairsStatsFile, int loadPairs, int minFreq, INT topK, int compactPairsData, string cuiRefFile, string nonLatestFile) {
+
+  const size_t cuiStringBytes = sizeof(string); // CUIs fit in the string object
+  double distinctCuis = 0; // CUIs dictionary: reference file and external resource
+  double coverage;
+
+  if (loadPairs) {
+    PairsStoreOptions floors = pairsStoreOptions(minFreq, topK, compactPairsData);
+    cerr << "Sampling pairs stats file '" << pairsStatsFile <<"'" <<endl;
+    INT sampledLines = 0;
+    INT sampledKept = 0;
+    unordered_map<string, INT> occurrences; // CUIs of the pairs with min freq (uniFreq)
+    unordered_map<string, INT> rowSampledLengths; // entries of the rows, pairs above the floors
+    vector<INT> sampledCounts;
+    double lines = sampleLines(pairsStatsFile, rate, 1, [&](string &str) {
+	vector<string> cols = split(str,'\t');
+	sampledLines++;
+	if ((cols.size()>=7) && (strtol(cols[2].c_str(), NULL,10) >= minFreq) && (strtol(cols[3].c_str(), NULL,10) >= minFreq)) {
+	  occurrences[cols[0]]++;
+	  occurrences[cols[1]]++;
+	  INT jointFreqVal = strtol(cols[6].c_str(), NULL,10);
+	  int kept = pairAboveFloors(cols, jointFreqVal, floors);
+	  if (kept < 0) {
+	    cerr << "Error: no PMI column in "<< pairsStatsFile << " line " << sampledLines+1 << endl;
+	    exit(1);
+	  }
+	  if (kept) {
+	    sampledKept++;
+	    rowSampledLengths[cols[0]]++;
+	    rowSampledLengths[cols[1]]++;
+	    sampledCounts.push_back(jointFreqVal);
+	  }
+	}
+      }, &coverage);
+    double keptPairs = (sampledLines > 0) ? lines * (double) sampledKept / (double) sampledLines : 0;
+    double pairsCuis = estimateDistinct(occurrences, coverage);
+    // the rows of the CUIs seen in the sample are extrapolated and truncated to K; the other
+    // rows share the remaining entries (they are short, so not truncated)
+    double entries = 2 * keptPairs;
+    double seenEntries = 0;
+    vector<double> rowLengths;
+    for (unordered_map<string, INT>::iterator it = rowSampledLengths.begin(); it != rowSampledLengths.end(); it++) {
+      double length = it->second / coverage;
+      seenEntries += length;
+      rowLengths.push_back(((topK > 0) && (length > topK)) ? topK : length);
+    }
+    double otherRows = max(estimateDistinct(rowSampledLengths, coverage) - (double) rowLengths.size(), 0.0);
+    double otherEntries = max(entries - seenEntries, 0.0);
+    double keptEntries = otherEntries;
+    for (double length : rowLengths) {
+      keptEntries += length;
+    }
+    for (size_t i=0; i<(size_t) otherRows; i++) {
+      rowLengths.push_back(otherEntries / otherRows);
+    }
+    cout << "Pairs stats file: "<<(INT) lines<<" pairs, "<<(INT) keptPairs<<" with min freq "<<minFreq;
+    cout << " and above the floors, "<<(INT) pairsCuis<<" CUIs, "<<(INT) keptEntries<<" row entries";
+    if (topK > 0) {
+      cout << " (top "<<topK<<")";
+    }
+    cout << "\n";
+    memory.uniFreq = estimateHashMapBytes(pairsCuis, sizeof(unordered_map<string, INT>::value_type));
+    if (compactPairsData) {
+      size_t indexBytes;
+      size_t dataBytes;
+      estimatePackedBytes(rowLengths, pairsCuis, sampledCounts, &indexBytes, &dataBytes);
+      memory.jointFreqIndex = indexBytes;
+      memory.jointFreqRows = dataBytes;
+      // dictionary of the pairs data: names, hash map and frequencies
+      memory.cuiDictionary = mallocBytes((size_t) pairsCuis * cuiStringBytes) + estimateHashMapBytes(pairsCuis, sizeof(unordered_map<string, uint32_t>::value_type)) + mallocBytes((size_t) pairsCuis * sizeof(INT));
+      cout << "  While loading with -C: "<<strMB((size_t) (keptPairs * 3 * sizeof(uint32_t) + 2 * keptPairs * sizeof(pair<uint32_t, uint32_t>)))<<" more for the pairs before packing\n";
+    } else {
+      memory.jointFreqIndex = estimateHashMapBytes(rowLengths.size(), sizeof(unordered_map<string, unordered_map<string, INT>*>::value_type));
+      // every pair is stored twice; every row is a hash map
+      memory.jointFreqRows = rowLengths.size() * mallocBytes(sizeof(unordered_map<string, INT>)) + estimateHashMapBytes(keptEntries, sizeof(unordered_map<string, INT>::value_type));
+      if (topK > 0) {
+	// truncated in place after loading: the rows keep the buckets of the full rows
+	size_t full = estimateHashMapBytes(entries, sizeof(unordered_map<string, INT>::value_type));
+	size_t fullBuckets = full - (size_t) entries * mallocBytes(sizeof(void *) + sizeof(unordered_map<string, INT>::value_type) + sizeof(size_t));
+	size_t keptBuckets = estimateHashMapBytes(keptEntries, sizeof(unordered_map<string, INT>::value_type)) - (size_t) keptEntries * mallocBytes(sizeof(void *) + sizeof(unordered_map<string, INT>::value_type) + sizeof(size_t));
+	memory.jointFreqRows += fullBuckets - keptBuckets;
+	cout << "  While loading: the rows are truncated to the top "<<topK<<" after loading, "<<strMB(full)<<" for the full rows\n";
+      }
+    }
+  }
+
+  if (cuiRefFile.length()>0) {
+    cerr << "Sampling reference file '" << cuiRefFile<<"'" <<endl;
+    unordered_map<string, INT> occurrences;
+    double lines = sampleLines(cuiRefFile, rate, 0, [&](string &str) {
+	occurrences[str.substr(0, str.find('\t'))]++;
+      }, &coverage);
+    double distinct = estimateDistinct(occurrences, coverage);
+    cout << "Reference file: "<<(INT) lines<<" terms, "<<(INT) distinct<<" CUIs\n";
+    memory.idToCui = mallocBytes((size_t) lines * sizeof(uint32_t));
+    distinctCuis = max(distinctCuis, distinct);
+  }
+
+  if (externalCuisByPmidOpts.size() == 4) {
+    string &filename = externalCuisByPmidOpts[0];
+    size_t colPMIDNo = atoi(externalCuisByPmidOpts[1].c_str()) - 1;
+    size_t colCuisNo = atoi(externalCuisByPmidOpts[2].c_str()) - 1;
+    char separator = externalCuisByPmidOpts[3].at(0);
+    cerr << "Sampling external CUIs file '" << filename <<"'" <<endl;
+    INT sampledLines = 0;
+    INT sampledCuis = 0;
+    unordered_map<string, INT> occurrences;
+    double lines = sampleLines(filename, rate, 0, [&](string &str) {
+	vector<string> cols = split(str,'\t');
+	sampledLines++;
+	if ((cols.size()>colPMIDNo) && (cols.size()>colCuisNo)) {
+	  for (string &cui : split(cols[colCuisNo], separator)) {
+	    if (cui.length()>0) {
+	      sampledCuis++;
+	      occurrences[cui]++;
+	    }
+	  }
+	}
+      }, &coverage);
+    double cuis = (sampledLines > 0) ? lines * (double) sampledCuis / (double) sampledLines : 0;
+    double distinct = estimateDistinct(occurrences, coverage);
+    cout << "External CUIs file: "<<(INT) lines<<" PMIDs, "<<(INT) cuis<<" CUIs ("<<(INT) distinct<<" distinct)\n";
+    memory.external = 2 * mallocBytes((size_t) lines * sizeof(uint32_t)) + mallocBytes((size_t) cuis * sizeof(uint32_t));
+    distinctCuis = max(distinctCuis, distinct);
+  }
+
+  if (nonLatestFile.length()>0) {
+    cerr << "Sampling non-latest PMID versions file '" << nonLatestFile <<"'" <<endl;
+    double lines = sampleLines(nonLatestFile, rate, 0, [](string & /*str*/) { }, &coverage);
+    cout << "Non-latest PMID versions file: "<<(INT) lines<<" versions\n";
+    memory.nonLatest = estimateHashMapBytes(lines, cuiStringBytes);
+  }
+
+  // the dictionary contains the CUIs of the reference file and external resource
+  if (distinctCuis > 0) {
+    memory.cuiDictionary += mallocBytes((size_t) distinctCuis * cuiStringBytes) + estimateHashMapBytes(distinctCuis, sizeof(unordered_map<string, uint32_t>::value_type));
+  }
+  memory.targetGroupsCache = 0;
+  memory.perDocPeak = 0;
+
+  cout << "\nEstimated memory (bytes) with sampling rate "<<rate<<" (target groups cache and per-document state not included):\n";
+  printMemoryBreakdown(cout);
+
+}
+
+
+
+void countDecision(Decision &d, BatchCounters &c) {
+  c.uniqueTotalCases++;
+  c.uniqueByOutcome[d.outcome]++;
+}
+
+
+void mergeBatchCounters(BatchCounters &c) {
+  timing.rows += c.rows;
+  timing.docs += c.docs;
+  timing.features += c.features;
+  timing.scoring += c.scoring;
+  for (int i=0; i<nbScoringTimeBuckets; i++) {
+    timing.scoringTimeHistogram[i] += c.scoringTimeHistogram[i];
+  }
+  totalDiscardedDueToNotInPairsData += c.discardedNotInPairsData;
+  uniqueTotalCases += c.uniqueTotalCases;
+  uniqueSuccess += c.uniqueByOutcome[OUTCOME_SUCCESS];
+  uniqueUnknownTarget += c.uniqueByOutcome[OUTCOME_UNKNOWN_TARGET];
+  uniqueMethodNA += c.uniqueByOutcome[OUTCOME_METHOD_NA];
+  uniqueThrehsholdReject += c.uniqueByOutcome[OUTCOME_THRESHOLD_REJECT];
+  equivalenceChecked += c.equivalenceChecked;
+  equivalenceMismatches += c.equivalenceMismatches;
+  equivalenceExplained += c.equivalenceExplained;
+  for (int i=0; i<4; i++) {
+    for (int j=0; j<4; j++) {
+      truncationTransitions[i][j] += c.truncationTransitions[i][j];
+    }
+  }
+  truncationOtherCui += c.truncationOtherCui;
+  decisionStoreLookups += c.storeLookups;
+  decisionStoreReused += c.storeReused;
+  decisionStoreReusedCases += c.storeReusedCases;
+}
+
+
+
+// returns position in array a if found, max if not found
+int findStrInArray(char *str, char **a, int max) {
+  for (int i=0; i< max; i++) {
+    if (strcmp(str, a[i]) == 0) {
+      return i;
+    }
+  }
+  return max;
+}
+
+
+
+vector<string> disambiguateNB_old(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
 
-vector<string> disambiguateBasic(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb, unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
-  
-  int nbTargets = targets.size();
   uniqueTotalCases++;
+  int nbTargets = targets.size();
   vector<string> res;
+  //  vector<string> selectedTargets;
+  INT *uniFreqTargets = (INT *) malloc(sizeof(INT) * nbTargets);
+  //  unordered_map<string, INT> uni; 
+  //unordered_map<string, unordered_map<string, INT>> featuresCuis;
+  unordered_map<string, INT *> featuresCuis;
+  //  unordered_map<string, unordered_map<string, INT>> featuresCuis;
+  //  unordered_map<string, double> pTargetGivenDoc;
+  double *pTargetGivenDoc = (double *) malloc(sizeof(double) * nbTargets);;
+
+  int noTargetFound = 1;
+  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+    string &target = targets[targetNo];
+    unordered_map<string, INT>::iterator itUni = uniFreq->find(target);
+    if ((itUni != uniFreq->end()) && (itUni->second >= minConceptFreq)) {
+      INT uniFreqVal = itUni->second;
+      uniFreqTargets[targetNo] = uniFreqVal;
+      noTargetFound = 0;
+      unordered_map<string, unordered_map<string, INT>*>::iterator itJoint = jointFreq->find(target);
+      if (itJoint != jointFreq->end()) {
+	unordered_map<string, INT> *m = itJoint->second;
+	for (unordered_map<string, INT>::iterator itThis = m->begin();  itThis != m->end(); itThis++) {
+	  string cui = itThis->first;
+	  int freqOk = minFreqThresholdDone;
+	  if (!freqOk) {
+	    unordered_map<string, INT>::iterator itCheckFreq = uniFreq->find(cui);
+	    freqOk = ((itCheckFreq != uniFreq->end()) && (itCheckFreq->second >= minConceptFreq));
+	  }
+	  if (freqOk) { // ok, include
+	    INT freq = itThis->second;
+	    unordered_map<string, INT*>::iterator it = featuresCuis.find(cui);
+	    INT *a; 
+	    if (it != featuresCuis.end()) {
+	      a =  it->second;
+	      //	      unordered_map<string, INT> &m = it->second;
+	      //	      m.insert({target, freq});
+	    } else {
+	      a =  (INT *) calloc(nbTargets, sizeof(INT)) ;
+	      //	      unordered_map<string, INT> m;
+	      //	      m.insert({target, freq});
+	      //	      featuresCuis.insert({cui, m});
+	      featuresCuis.insert({cui, a});
+	    }
+	    a[targetNo] = freq;
+	  }
+	}
+      }
+      pTargetGivenDoc[targetNo] = (double) uniFreqVal / (double) totalNbDocs ; // p(C)
+      //      selectedTargets.push_back(target);
+    } else {
+      if (!ignoreTargetIfNotInPairsData) {
+	uniqueUnknownTarget++;
+	for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
+	free(uniFreqTargets);
+	free(pTargetGivenDoc);
+	return res; // return empty
+      }
+      uniFreqTargets[targetNo] =  0;
+      pTargetGivenDoc[targetNo] = 0; // p(C)
+    }
+  }
+  if (noTargetFound) {
+    uniqueUnknownTarget++;
+    for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
+    free(uniFreqTargets);
+    free(pTargetGivenDoc);
+    return res; // return empty
+  }
+
+  for (unordered_map<string, INT *>::iterator it = featuresCuis.begin(); it != featuresCuis.end(); it++) {
+    string featureCui = it->first;
+    INT *jointFreqFeatureByTarget = it->second;
+    //    cerr << "DEBUG featureCui="<<featureCui<<endl;
+    unordered_map<string, INT>::iterator itFoundInFeat = features.find(featureCui);
+    int featPresent = (itFoundInFeat != features.end());
+    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+      //      string &target = targets[targetNo];
+      //      unordered_map<string, INT>::iterator itJFreq = jointFreqFeatureByTarget.find(target);
+      //      INT jointFreqCuiTarget = (itJFreq != jointFreqFeatureByTarget.end()) ? itJFreq->second : 0 ;
+      INT  jointFreqCuiTarget = jointFreqFeatureByTarget[targetNo];
+      //      cerr << "  DEBUG targetNo="<<targetNo<<" ; target = "<<targets[targetNo]<<" ; jointFreqCuiTarget="<<jointFreqCuiTarget<<endl;
+      double pFeatGivenTarget = (double) jointFreqCuiTarget / (double) uniFreqTargets[targetNo];
+      //      unordered_map<string, double>::iterator itTargetGivenDoc = pTargetGivenDoc.find(target);
+      //      if (itTargetGivenDoc == pTargetGivenDoc.end()) {
+      //	cerr << "Bug\n";
+      //	exit(52);
+      //      }
+      //	itTargetGivenDoc->second *= (double) pFeatGivenTarget;  // * p(Xi|C)
+      if (featPresent) {
+	pTargetGivenDoc[targetNo] *= (double) pFeatGivenTarget;  // * p(Xi|C)
+      } else {
+	//	itTargetGivenDoc->second *= ((double) 1 - (double) pFeatGivenTarget);   // * p(Xi|C)
+	pTargetGivenDoc[targetNo] *= ((double) 1 - (double) pFeatGivenTarget);   // * p(Xi|C)
+      }
+    }
+  }
+  // DEBUG  if (totalAmbig>10) {
+  //    cerr <<"EXIT"<<endl;
+  //    exit(1);
+  //  }
+
+  for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
+  free(uniFreqTargets);
+  double marginal = 0;
+  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+    marginal += pTargetGivenDoc[targetNo];
+  }
+  if (marginal == 0) {
+    uniqueMethodNA++;
+    free(pTargetGivenDoc);
+    return res; // return empty
+  } else {
+    int maxTargetNo=-1;
+    double maxP=-1;
+    //    cerr << "DEBUG FINAL -- marginal="<<marginal<<endl;
+    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+      //      string &target = targets[targetNo];
+      double p = pTargetGivenDoc[targetNo] / marginal;
+      //      cerr <<"  target="<<target<<": "<<p<<endl;
+      if (p > maxP) {
+	maxTargetNo = targetNo;
+	maxP = p;
+      }
+    }
+    free(pTargetGivenDoc);
+    if (maxP > minPosteriorProb) {
+      uniqueSuccess++;
+      res.push_back(targets[maxTargetNo]);
+      return res;
+    } else {
+      uniqueThrehsholdReject++;
+      return res; // return empty
+    }
+  }
+  
+
+}
+
+
+
+
+
+/*
+ * Legacy implementation, used as reference by the equivalence check (option -X).
+ * These are frozen copies of the original methods: they must not be optimized or modified,
+ * the corresponding disambiguate* functions can be.
+ */
+
+Decision legacyDisambiguateBasic(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb, unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
+  
+  int nbTargets = targets.size();
   INT *countMatches = (INT *) calloc(nbTargets, sizeof(INT));
   INT totalMatches = 0;
   
@@ -268,9 +1542,8 @@ vector<string> disambiguateBasic(vector<string> &targets, unordered_map<string,
     }
   }
   if (totalMatches == 0) {
-    uniqueMethodNA++;
     free(countMatches);
-    return res; //empty
+    return makeDecision(OUTCOME_METHOD_NA, -1, -1);
   } else {
     int maxTargetNo = -1;
     double maxP = -1;
@@ -279,39 +1552,23 @@ vector<string> disambiguateBasic(vector<string> &targets, unordered_map<string,
       double p = (double) c / (double) totalMatches;
       if (p > maxP) {
 	maxTargetNo = targetNo;
-	maxP = p;
-      }
-    }
-    free(countMatches);
-    if (maxP > minPosteriorProb) {
-      uniqueSuccess++;
-      res.push_back(targets[maxTargetNo]);
-      return res;
-    } else {
-      uniqueThrehsholdReject++;
-      return res; // return empty
+	maxP = p;
+      }
     }
-  }
-}
-
-
-// returns position in array a if found, max if not found
-int findStrInArray(char *str, char **a, int max) {
-  for (int i=0; i< max; i++) {
-    if (strcmp(str, a[i]) == 0) {
-      return i;
+    free(countMatches);
+    if (maxP > minPosteriorProb) {
+      return makeDecision(OUTCOME_SUCCESS, maxTargetNo, maxP);
+    } else {
+      return makeDecision(OUTCOME_THRESHOLD_REJECT, maxTargetNo, maxP);
     }
   }
-  return max;
 }
 
 
 
-vector<string> disambiguateNB(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
+Decision legacyDisambiguateNB(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
 
-  uniqueTotalCases++;
   int nbTargets = targets.size();
-  vector<string> res;
   //  vector<string> selectedTargets;
   INT *uniFreqTargets = (INT *) malloc(sizeof(INT) * nbTargets);
   //  unordered_map<string, INT> uni; 
@@ -346,10 +1603,9 @@ vector<string> disambiguateNB(vector<string> &targets, unordered_map<string, INT
       pTargetGivenDoc[targetNo] = (double) uniFreqVal / (double) totalNbDocs ; // p(C)
     } else {
       if (!ignoreTargetIfNotInPairsData) {
-	uniqueUnknownTarget++;
 	free(uniFreqTargets);
 	free(pTargetGivenDoc);
-	return res; // return empty
+	return makeDecision(OUTCOME_UNKNOWN_TARGET, -1, -1);
       }
       uniFreqTargets[targetNo] =  0;
       pTargetGivenDoc[targetNo] = 0; // p(C)
@@ -358,10 +1614,9 @@ vector<string> disambiguateNB(vector<string> &targets, unordered_map<string, INT
     }
   }
   if (noTargetFound) {
-    uniqueUnknownTarget++;
     free(uniFreqTargets);
     free(pTargetGivenDoc);
-    return res; // return empty
+    return makeDecision(OUTCOME_UNKNOWN_TARGET, -1, -1);
   }
 
   // allocate for the max possible number of features
@@ -432,154 +1687,8 @@ vector<string> disambiguateNB(vector<string> &targets, unordered_map<string, INT
     marginal += pTargetGivenDoc[targetNo];
   }
   if (marginal == 0) {
-    uniqueMethodNA++;
-    free(pTargetGivenDoc);
-    return res; // return empty
-  } else {
-    int maxTargetNo=-1;
-    double maxP=-1;
-    //    cerr << "DEBUG FINAL -- marginal="<<marginal<<endl;
-    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
-      //      string &target = targets[targetNo];
-      double p = pTargetGivenDoc[targetNo] / marginal;
-      //      cerr <<"  target="<<target<<": "<<p<<endl;
-      if (p > maxP) {
-	maxTargetNo = targetNo;
-	maxP = p;
-      }
-    }
-    free(pTargetGivenDoc);
-    if (maxP > minPosteriorProb) {
-      uniqueSuccess++;
-      res.push_back(targets[maxTargetNo]);
-      return res;
-    } else {
-      uniqueThrehsholdReject++;
-      return res; // return empty
-    }
-  }
-  
-
-}
-
-
-
-
-vector<string> disambiguateNB_old(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
-
-  uniqueTotalCases++;
-  int nbTargets = targets.size();
-  vector<string> res;
-  //  vector<string> selectedTargets;
-  INT *uniFreqTargets = (INT *) malloc(sizeof(INT) * nbTargets);
-  //  unordered_map<string, INT> uni; 
-  //unordered_map<string, unordered_map<string, INT>> featuresCuis;
-  unordered_map<string, INT *> featuresCuis;
-  //  unordered_map<string, unordered_map<string, INT>> featuresCuis;
-  //  unordered_map<string, double> pTargetGivenDoc;
-  double *pTargetGivenDoc = (double *) malloc(sizeof(double) * nbTargets);;
-
-  int noTargetFound = 1;
-  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
-    string &target = targets[targetNo];
-    unordered_map<string, INT>::iterator itUni = uniFreq->find(target);
-    if ((itUni != uniFreq->end()) && (itUni->second >= minConceptFreq)) {
-      INT uniFreqVal = itUni->second;
-      uniFreqTargets[targetNo] = uniFreqVal;
-      noTargetFound = 0;
-      unordered_map<string, unordered_map<string, INT>*>::iterator itJoint = jointFreq->find(target);
-      if (itJoint != jointFreq->end()) {
-	unordered_map<string, INT> *m = itJoint->second;
-	for (unordered_map<string, INT>::iterator itThis = m->begin();  itThis != m->end(); itThis++) {
-	  string cui = itThis->first;
-	  int freqOk = minFreqThresholdDone;
-	  if (!freqOk) {
-	    unordered_map<string, INT>::iterator itCheckFreq = uniFreq->find(cui);
-	    freqOk = ((itCheckFreq != uniFreq->end()) && (itCheckFreq->second >= minConceptFreq));
-	  }
-	  if (freqOk) { // ok, include
-	    INT freq = itThis->second;
-	    unordered_map<string, INT*>::iterator it = featuresCuis.find(cui);
-	    INT *a; 
-	    if (it != featuresCuis.end()) {
-	      a =  it->second;
-	      //	      unordered_map<string, INT> &m = it->second;
-	      //	      m.insert({target, freq});
-	    } else {
-	      a =  (INT *) calloc(nbTargets, sizeof(INT)) ;
-	      //	      unordered_map<string, INT> m;
-	      //	      m.insert({target, freq});
-	      //	      featuresCuis.insert({cui, m});
-	      featuresCuis.insert({cui, a});
-	    }
-	    a[targetNo] = freq;
-	  }
-	}
-      }
-      pTargetGivenDoc[targetNo] = (double) uniFreqVal / (double) totalNbDocs ; // p(C)
-      //      selectedTargets.push_back(target);
-    } else {
-      if (!ignoreTargetIfNotInPairsData) {
-	uniqueUnknownTarget++;
-	for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
-	free(uniFreqTargets);
-	free(pTargetGivenDoc);
-	return res; // return empty
-      }
-      uniFreqTargets[targetNo] =  0;
-      pTargetGivenDoc[targetNo] = 0; // p(C)
-    }
-  }
-  if (noTargetFound) {
-    uniqueUnknownTarget++;
-    for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
-    free(uniFreqTargets);
-    free(pTargetGivenDoc);
-    return res; // return empty
-  }
-
-  for (unordered_map<string, INT *>::iterator it = featuresCuis.begin(); it != featuresCuis.end(); it++) {
-    string featureCui = it->first;
-    INT *jointFreqFeatureByTarget = it->second;
-    //    cerr << "DEBUG featureCui="<<featureCui<<endl;
-    unordered_map<string, INT>::iterator itFoundInFeat = features.find(featureCui);
-    int featPresent = (itFoundInFeat != features.end());
-    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
-      //      string &target = targets[targetNo];
-      //      unordered_map<string, INT>::iterator itJFreq = jointFreqFeatureByTarget.find(target);
-      //      INT jointFreqCuiTarget = (itJFreq != jointFreqFeatureByTarget.end()) ? itJFreq->second : 0 ;
-      INT  jointFreqCuiTarget = jointFreqFeatureByTarget[targetNo];
-      //      cerr << "  DEBUG targetNo="<<targetNo<<" ; target = "<<targets[targetNo]<<" ; jointFreqCuiTarget="<<jointFreqCuiTarget<<endl;
-      double pFeatGivenTarget = (double) jointFreqCuiTarget / (double) uniFreqTargets[targetNo];
-      //      unordered_map<string, double>::iterator itTargetGivenDoc = pTargetGivenDoc.find(target);
-      //      if (itTargetGivenDoc == pTargetGivenDoc.end()) {
-      //	cerr << "Bug\n";
-      //	exit(52);
-      //      }
-      //	itTargetGivenDoc->second *= (double) pFeatGivenTarget;  // * p(Xi|C)
-      if (featPresent) {
-	pTargetGivenDoc[targetNo] *= (double) pFeatGivenTarget;  // * p(Xi|C)
-      } else {
-	//	itTargetGivenDoc->second *= ((double) 1 - (double) pFeatGivenTarget);   // * p(Xi|C)
-	pTargetGivenDoc[targetNo] *= ((double) 1 - (double) pFeatGivenTarget);   // * p(Xi|C)
-      }
-    }
-  }
-  // DEBUG  if (totalAmbig>10) {
-  //    cerr <<"EXIT"<<endl;
-  //    exit(1);
-  //  }
-
-  for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
-  free(uniFreqTargets);
-  double marginal = 0;
-  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
-    marginal += pTargetGivenDoc[targetNo];
-  }
-  if (marginal == 0) {
-    uniqueMethodNA++;
     free(pTargetGivenDoc);
-    return res; // return empty
+    return makeDecision(OUTCOME_METHOD_NA, -1, -1);
   } else {
     int maxTargetNo=-1;
     double maxP=-1;
@@ -595,12 +1704,9 @@ vector<string> disambiguateNB_old(vector<string> &targets, unordered_map<string,
     }
     free(pTargetGivenDoc);
     if (maxP > minPosteriorProb) {
-      uniqueSuccess++;
-      res.push_back(targets[maxTargetNo]);
-      return res;
+      return makeDecision(OUTCOME_SUCCESS, maxTargetNo, maxP);
     } else {
-      uniqueThrehsholdReject++;
-      return res; // return empty
+      return makeDecision(OUTCOME_THRESHOLD_REJECT, maxTargetNo, maxP);
     }
   }
   
@@ -609,21 +1715,17 @@ vector<string> disambiguateNB_old(vector<string> &targets, unordered_map<string,
 
 
 
-
-
-vector<string> disambiguateAdvanced(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
+Decision legacyDisambiguateAdvanced(vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
 
   
   
 
-  uniqueTotalCases++;
   int nbTargets = targets.size();
   //  unordered_map<string, INT> uni;
   INT *uniFreqTargets = (INT *) malloc(sizeof(INT) * nbTargets);
   //unordered_map<string, unordered_map<string, INT>> featuresCuis;
   //  unordered_map<string, INT *> featuresCuis;
   INT *countMatches = (INT *) calloc(nbTargets, sizeof(INT));
-  vector<string> res;
 
   int noTargetFound = 1;
   for (int targetNo=0; targetNo<nbTargets; targetNo++) {
@@ -666,19 +1768,17 @@ vector<string> disambiguateAdvanced(vector<string> &targets, unordered_map<strin
       //      selectedTargets.push_back(target);
     } else {
       if (!ignoreTargetIfNotInPairsData) {
-	uniqueUnknownTarget++;
 	//	for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
 	free(uniFreqTargets);
-	return res; // return empty
+	return makeDecision(OUTCOME_UNKNOWN_TARGET, -1, -1);
       }
       uniFreqTargets[targetNo] =  0;
     }
   }
   if (noTargetFound) {
-    uniqueUnknownTarget++;
     //    for (unordered_map<string, INT *>::iterator itFree=featuresCuis.begin(); itFree != featuresCuis.end(); itFree++) { free(itFree->second); }
     free(uniFreqTargets);
-    return res; // return empty
+    return makeDecision(OUTCOME_UNKNOWN_TARGET, -1, -1);
   }
 
   INT totalMatches = 0;
@@ -721,9 +1821,8 @@ vector<string> disambiguateAdvanced(vector<string> &targets, unordered_map<strin
   free(uniFreqTargets);
 
   if (totalMatches == 0) {
-    uniqueMethodNA++;
     free(countMatches);
-    return res; //empty
+    return makeDecision(OUTCOME_METHOD_NA, -1, -1);
   } else {
     int maxTargetNo = -1;
     double maxP = -1;
@@ -739,67 +1838,299 @@ vector<string> disambiguateAdvanced(vector<string> &targets, unordered_map<strin
     }
     free(countMatches);
     if (maxP > minPosteriorProb) {
-      uniqueSuccess++;
-      res.push_back(targets[maxTargetNo]);
-      return res;
+      return makeDecision(OUTCOME_SUCCESS, maxTargetNo, maxP);
     } else {
-      uniqueThrehsholdReject++;
-      return res; // return empty
+      return makeDecision(OUTCOME_THRESHOLD_REJECT, maxTargetNo, maxP);
+    }
+
+
+  }
+     
+
+
+  
+
+}
+
+
+
+Decision legacyDisambiguate(string &method, vector<string> &targets, unordered_map<string, INT> &features, int minConceptFreq, double minPosteriorProb,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
+  if (method == "basic") {
+    return legacyDisambiguateBasic(targets, features, minConceptFreq, minPosteriorProb, uniFreq, jointFreq);
+  } else if (method == "advanced") {
+    return legacyDisambiguateAdvanced(targets, features, minConceptFreq, minPosteriorProb, uniFreq, jointFreq);
+  } else {
+    return legacyDisambiguateNB(targets, features, minConceptFreq, minPosteriorProb, uniFreq, jointFreq);
+  }
+}
+
+
+// returns 1 if the decisions are equivalent
+int sameDecision(Decision &d1, Decision &d2, double tolerance) {
+  if (d1.outcome != d2.outcome) {
+    return 0;
+  }
+  if ((d1.outcome == OUTCOME_SUCCESS) && (d1.targetNo != d2.targetNo)) {
+    return 0;
+  }
+  return (fabs(d1.posterior - d2.posterior) <= tolerance);
+}
+
+
+// compares the decision with the legacy implementation for the same case, writes the case to the report if different
+void checkEquivalence(string &pmid, string &method, vector<string> &targets, unordered_map<string, INT> &features, Decision &decision, Decision legacy, BatchCounters &c) {
+
+  c.equivalenceChecked++;
+  if (sameDecision(decision, legacy, equivalenceTolerance)) {
+    return;
+  }
+  c.equivalenceMismatches++;
+  // a different outcome is explained if it is due to the threshold with close enough posteriors
+  int explained = (decision.outcome == OUTCOME_SUCCESS || decision.outcome == OUTCOME_THRESHOLD_REJECT) &&
+    (legacy.outcome == OUTCOME_SUCCESS || legacy.outcome == OUTCOME_THRESHOLD_REJECT) &&
+    (fabs(decision.posterior - legacy.posterior) <= equivalenceTolerance);
+  if (explained) {
+    c.equivalenceExplained++;
+  }
+  vector<string> featuresList;
+  for (unordered_map<string, INT>::iterator it = features.begin(); it != features.end(); it++) {
+    featuresList.push_back(it->first+":"+to_string(it->second));
+  }
+  std::sort(featuresList.begin(), featuresList.end());
+  lock_guard<mutex> lock(diagnosticsMutex);
+  *equivalenceFH << pmid << "\t" << method << "\t" << join(targets, ",");
+  *equivalenceFH << "\t" << outcomeNames[decision.outcome] << "\t" << ((decision.targetNo >= 0) ? targets[decision.targetNo] : "") << "\t" << decision.posterior;
+  *equivalenceFH << "\t" << outcomeNames[legacy.outcome] << "\t" << ((legacy.targetNo >= 0) ? targets[legacy.targetNo] : "") << "\t" << legacy.posterior;
+  *equivalenceFH << "\t" << (explained ? "yes" : "no") << "\t" << join(featuresList, " ") << "\n";
+
+}
+
+
+
+
+void compareWithFullData(Decision &decision, Decision full, BatchCounters &c) {
+  c.truncationTransitions[full.outcome][decision.outcome]++;
+  if ((full.outcome == OUTCOME_SUCCESS) && (decision.outcome == OUTCOME_SUCCESS) && (full.targetNo != decision.targetNo)) {
+    c.truncationOtherCui++;
+  }
+}
+
+
+void printTruncationReport(ostream &out) {
+  INT compared = 0;
+  INT same = 0;
+  for (int i=0; i<4; i++) {
+    for (int j=0; j<4; j++) {
+      compared += truncationTransitions[i][j];
+    }
+    same += truncationTransitions[i][i];
+  }
+  same -= truncationOtherCui;
+  out << "Truncated pairs data compared with the full pairs data (option -R): "<<compared<<" cases\n";
+  out << "  Top K: "<<topKNeighbours<<"; min joint freq: "<<minJointFreq<<"; min PMI: "<<minPMI<<"\n";
+  out << "  Joint frequency entries: "<<jointFreqEntries<<" / "<<fullJointFreqEntries<<" ("<<strProp(jointFreqEntries,fullJointFreqEntries)<<" %)\n";
+  out << "  Same decision: "<<same<<" ("<<strProp(same,compared)<<" %)\n";
+  out << "  Success, other CUI selected: "<<truncationOtherCui<<" ("<<strProp(truncationOtherCui,compared)<<" %)\n";
+  for (int i=0; i<4; i++) {
+    for (int j=0; j<4; j++) {
+      if ((i != j) && (truncationTransitions[i][j] > 0)) {
+	out << "  "<<outcomeNames[i]<<" -> "<<outcomeNames[j]<<": "<<truncationTransitions[i][j]<<" ("<<strProp(truncationTransitions[i][j],compared)<<" %)\n";
+      }
+    }
+  }
+  out << "\n";
+}
+
+
+// one line by combination of parameters, the file is created by the first call
+void writeTruncationSummary(string filename, int first, string &method, int minConceptFreq, double minPosteriorProb) {
+
+  ofstream outFH(filename, first ? ios::trunc : ios::app);
+  if (!outFH) {
+    cerr << "Error opening "<< filename << endl;
+    exit(1);
+  }
+  if (first) {
+    outFH << "method\tminConceptFreq\tminPosteriorProb\ttopK\tminJointFreq\tminPMI\tjointEntries\tfullJointEntries\tjointRowsBytes";
+    outFH << "\tcases\tsameDecision\totherCui";
+    outFH << "\tsuccessFull\tsuccess\tunknownTargetFull\tunknownTarget\tmethodNAFull\tmethodNA\tthresholdRejectFull\tthresholdReject\n";
+  }
+  INT compared = 0;
+  INT same = 0;
+  INT byOutcomeFull[4] = { 0, 0, 0, 0 };
+  INT byOutcome[4] = { 0, 0, 0, 0 };
+  for (int i=0; i<4; i++) {
+    for (int j=0; j<4; j++) {
+      compared += truncationTransitions[i][j];
+      byOutcomeFull[i] += truncationTransitions[i][j];
+      byOutcome[j] += truncationTransitions[i][j];
     }
+    same += truncationTransitions[i][i];
+  }
+  outFH << method << "\t" << minConceptFreq << "\t" << minPosteriorProb << "\t" << topKNeighbours << "\t" << minJointFreq << "\t" << minPMI;
+  outFH << "\t" << jointFreqEntries << "\t" << fullJointFreqEntries << "\t" << memory.jointFreqRows;
+  outFH << "\t" << compared << "\t" << same - truncationOtherCui << "\t" << truncationOtherCui;
+  for (int i=0; i<4; i++) {
+    outFH << "\t" << byOutcomeFull[i] << "\t" << byOutcome[i];
+  }
+  outFH << "\n";
+  outFH.close();
+
+}
+
+
+void profileGroup(TargetGroup *group, Decision &decision, double seconds, unordered_map<string, unordered_map<string, INT>*> *jointFreq) {
+
+  lock_guard<mutex> lock(diagnosticsMutex);
+  if (group->profile == NULL) {
+    unordered_map<string, GroupProfile>::iterator it = groupProfiles.find(group->sortedCuisStr);
+    if (it == groupProfiles.end()) {
+      GroupProfile p = {};
+      for (string &target : group->cuis) {
+	unordered_map<string, unordered_map<string, INT>*>::iterator itRow = jointFreq->find(target);
+	if (itRow != jointFreq->end()) {
+	  p.rowsSize += itRow->second->size();
+	}
+	if (packedJointFreq != NULL) {
+	  p.rowsSize += packedRowLength(*packedJointFreq, packedRowOf(pairsCuiIdByName, target));
+	}
+      }
+      it = groupProfiles.insert({group->sortedCuisStr, p}).first;
+    }
+    group->profile = &it->second;
+  }
+  group->profile->calls++;
+  group->profile->scoring += seconds;
+  group->profile->outcomes[decision.outcome]++;
+
+}
+
 
+// writes the top N groups by cumulative scoring time
+void writeHotGroups(string filename) {
 
+  ofstream outFH(filename);
+  if (!outFH) {
+    cerr << "Error opening "<< filename << endl;
+    exit(1);
   }
-     
+  vector<unordered_map<string, GroupProfile>::iterator> groups;
+  for (unordered_map<string, GroupProfile>::iterator it = groupProfiles.begin(); it != groupProfiles.end(); it++) {
+    groups.push_back(it);
+  }
+  size_t n = min((size_t) hotGroupsTopN, groups.size());
+  partial_sort(groups.begin(), groups.begin()+n, groups.end(), [](const unordered_map<string, GroupProfile>::iterator &a, const unordered_map<string, GroupProfile>::iterator &b) {
+      return (a->second.scoring > b->second.scoring) || ((a->second.scoring == b->second.scoring) && (a->first < b->first));
+    });
+  outFH << "rank\ttargets\tnbTargets\tcalls\trowsSize\tscoringSeconds\tscoringProp\tmeanMicroseconds";
+  outFH << "\tsuccess\tunknownTarget\tmethodNA\tthresholdReject\n";
+  for (size_t i=0; i<n; i++) {
+    GroupProfile &p = groups[i]->second;
+    outFH << i+1 << "\t" << groups[i]->first << "\t" << count(groups[i]->first.begin(), groups[i]->first.end(), ',')+1;
+    outFH << "\t" << p.calls << "\t" << p.rowsSize << "\t" << p.scoring << "\t" << ((timing.scoring > 0) ? p.scoring / timing.scoring : 0);
+    outFH << "\t" << p.scoring * 1e6 / p.calls;
+    for (int outcome=0; outcome<4; outcome++) {
+      outFH << "\t" << p.outcomes[outcome];
+    }
+    outFH << "\n";
+  }
+  outFH.close();
 
+}
 
-  
+
+
+TargetGroup *resolveTargetGroup(string &cuisOrIdsStr, int minConceptFreq, vector<uint32_t> *idToCui,  unordered_map<string, INT>* uniFreq, unordered_map<string, TargetGroup> &targetGroupsCache) {
+
+  unordered_map<string, TargetGroup>::iterator itCache = targetGroupsCache.find(cuisOrIdsStr);
+  if (itCache != targetGroupsCache.end()) {
+    return &itCache->second;
+  }
+  vector<string> cuisOrIds = split(cuisOrIdsStr, ',');
+  if (idToCui != NULL) {
+    for (int i=0; i< cuisOrIds.size(); i++) {
+      INT id = strtol(cuisOrIds[i].c_str(), NULL,10);
+      if ((id >= 0) && ((size_t) id < idToCui->size())) {
+	cuisOrIds[i] = cuiNames[(*idToCui)[id]];
+      } else {
+	cerr << "Error: cannot find id "<<id<<" in the id to CUI map.\n";
+	exit(6);
+      }
+    }
+  }
+  if (ignoreTargetIfNotInPairsData && (cuisOrIds.size()>1)) {  
+    // if option enabled, discard any cui which is not in pairs data. 
+    // This might cause the ambiguous group to be "downgraded" to a single non-ambiguous target
+    // CAUTION: what if no CUI left at all?
+    vector<string> passedCuis;
+    for (string &cui : cuisOrIds) {
+      unordered_map<string, INT>::iterator it = uniFreq->find(cui);
+      if ((it != uniFreq->end()) && (it->second >= minConceptFreq)) {
+	passedCuis.push_back(cui);
+      }
+    }
+    cuisOrIds = passedCuis;
+  }
+  TargetGroup &group = targetGroupsCache[cuisOrIdsStr];
+  group.cuis = cuisOrIds;
+  std::sort(cuisOrIds.begin(), cuisOrIds.end());
+  group.sortedCuisStr = join(cuisOrIds,",");
+  group.profile = NULL;
+  return &group;
 
 }
 
 
 
-void processOneDoc(string &pmid, ofstream &outFH, unordered_map<string, string> &doc, string &method, int minConceptFreq, double minPosteriorProb, unordered_map<INT, string> *idToCui,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq, unordered_map<string, vector<string>> *externalCuisByPMid) {
+/*
+ * Documents are processed by batch (option -W): the ambiguity cases of all the documents in the
+ * batch are scored grouped by target group, so that the data for a group (in particular the NB
+ * table and the co-occurrence rows of the targets) is used for all its cases at once. The
+ * documents are then written in the original order.
+ */
+struct AmbiguityCase {
+  string cuisOrIdsStr;
+  TargetGroup *group;
+  int outcome; // once scored
+};
 
+struct DocState {
+  string pmid;
+  unordered_map<string, string> doc;
   unordered_map<string, string> single;
-  unordered_map<string, vector<string>> multi;
+  unordered_map<string, TargetGroup *> multi;
+  unordered_map<string, INT> features; // of the first case, before excluding any target: see caseFeatures()
+  vector<AmbiguityCase> cases; // in the order of 'multi'
+  unordered_map<string, vector<string>> disamb;
+  string storeKey; // option -U
+  int reused; // decisions taken from the decision store
+};
+
+struct Batch {
+  vector<DocState> docs;
+  BatchCounters counters;
+};
+
+
+// resolves the CUIs of the document and collects its ambiguity cases together with their features
+void collectDocCases(DocState &state, BatchCounters &c, unordered_map<string, TargetGroup> &targetGroupsCache, int minConceptFreq, vector<uint32_t> *idToCui,  unordered_map<string, INT>* uniFreq, ExternalResource *externalCuisByPMid) {
+
+  double t0 = nowSeconds();
+  string &pmid = state.pmid;
+  unordered_map<string, string> &single = state.single;
+  unordered_map<string, TargetGroup *> &multi = state.multi;
   unordered_map<string, INT> countSingle;
-  unordered_map<string, string> originalMulti;
+  c.docs++;
 
   unordered_map<string, string>::iterator it;
-  for ( it = doc.begin(); it != doc.end(); it++ )  {
+  for ( it = state.doc.begin(); it != state.doc.end(); it++ )  {
     string docKey = it->first;
-    string cuisOrIdsStr = it->second;
-    vector<string> cuisOrIds = split(cuisOrIdsStr, ',');
-    if (idToCui != NULL) {
-      for (int i=0; i< cuisOrIds.size(); i++) {
-	INT id = strtol(cuisOrIds[i].c_str(), NULL,10);
-	unordered_map<INT, string>::iterator itRef = idToCui->find(id);
-	if (itRef != idToCui->end()) {
-	  cuisOrIds[i] = itRef->second;
-	} else {
-	  cerr << "Error: cannot find id "<<id<<" in the id to CUI map.\n";
-	  exit(6);
-	}
-      }
-    }
-    if (ignoreTargetIfNotInPairsData && (cuisOrIds.size()>1)) {  
-      // if option enabled, discard any cui which is not in pairs data. 
-      // This might cause the ambiguous group to be "downgraded" to a single non-ambiguous target
-      // CAUTION: what if no CUI left at all?
-      vector<string> passedCuis;
-      for (string &cui : cuisOrIds) {
-	unordered_map<string, INT>::iterator it = uniFreq->find(cui);
-	if ((it != uniFreq->end()) && (it->second >= minConceptFreq)) {
-	  passedCuis.push_back(cui);
-	}
-      }
-      cuisOrIds = passedCuis;
-    }
+    string &cuisOrIdsStr = it->second;
+    TargetGroup *group = resolveTargetGroup(cuisOrIdsStr, minConceptFreq, idToCui, uniFreq, targetGroupsCache);
+    vector<string> &cuisOrIds = group->cuis;
     if (cuisOrIds.size()>0) {
       if (cuisOrIds.size()>1) {
-	multi.insert({ cuisOrIdsStr, cuisOrIds });
-	std::sort(cuisOrIds.begin(), cuisOrIds.end());
-	originalMulti.insert({  cuisOrIdsStr, join(cuisOrIds,",") });
+	multi.insert({ cuisOrIdsStr, group });
       } else {
 	single.insert({ cuisOrIdsStr, cuisOrIds[0] });
 	unordered_map<string, INT>::iterator sc = countSingle.find(cuisOrIds[0]);
@@ -810,18 +2141,18 @@ void processOneDoc(string &pmid, ofstream &outFH, unordered_map<string, string>
 	}
       }
     } else { // if no CUI left at all due to ignoreTargetIfNotInPairsData, ignore entirely
-      totalDiscardedDueToNotInPairsData++;
+      c.discardedNotInPairsData++;
     }
   }
 
   if (externalCuisByPMid != NULL) { // adding external CUIs based on PMID (typically from Mesh descriptors) to features
-    if (pmid.substr(0,6) != "NOPMID") {
-      string realPmid = split(pmid, '.')[0];
-      unordered_map<string, vector<string>>::iterator itExtern =  externalCuisByPMid->find(realPmid);
-      if (itExtern != externalCuisByPMid->end()) {
-	//	cerr << "DEBUG: external cuis found for pmid "<<realPmid<<endl;
-	vector<string> &externCuis = itExtern->second;
-	for (string c: externCuis) {
+    uint32_t realPmid;
+    if (parsePmid(pmid.c_str(), min(pmid.find('.'), pmid.length()), &realPmid)) { // excludes 'NOPMID'
+      vector<uint32_t>::iterator itExtern = lower_bound(externalCuisByPMid->pmids.begin(), externalCuisByPMid->pmids.end(), realPmid);
+      if ((itExtern != externalCuisByPMid->pmids.end()) && (*itExtern == realPmid)) {
+	size_t pmidNo = itExtern - externalCuisByPMid->pmids.begin();
+	for (uint32_t i=externalCuisByPMid->cuisStart[pmidNo]; i<externalCuisByPMid->cuisStart[pmidNo+1]; i++) {
+	  string &c = cuiNames[externalCuisByPMid->cuiIds[i]];
 	  unordered_map<string, INT>::iterator sc = countSingle.find(c);
 	  if (sc != countSingle.end()) {
 	    (sc->second)++;
@@ -829,69 +2160,77 @@ void processOneDoc(string &pmid, ofstream &outFH, unordered_map<string, string>
 	    countSingle.insert({c, 1});
 	  }
 	}
-	//      } else {
-	//	cerr << "DEBUG: external cuis NOT found for pmid "<<realPmid<<endl;
       }
     }
   }
 
-
-  unordered_map<string, vector<string>> disamb;
-  unordered_map<string, vector<string>>::iterator itamb;
+  state.features.swap(countSingle);
+  unordered_map<string, TargetGroup *>::iterator itamb;
   for (itamb = multi.begin(); itamb != multi.end(); itamb++ )  {
-    string cuisOrIdsStr = itamb->first;
-    vector<string> &cuis = itamb->second;
-    vector<string> res;
-    if (method == "basic") {
-      res = disambiguateBasic(cuis, countSingle, minConceptFreq, minPosteriorProb, uniFreq, jointFreq);
-    } else {
-      // for both advanced and NB, exclude target CUIs from features
-      for (string &target : cuis) {
-	unordered_map<string, INT>::iterator itRm = countSingle.find(target);
-	if (itRm != countSingle.end()) {
-	  countSingle.erase(itRm);
-	}
-      }
-      if (method == "advanced") {
-	res = disambiguateAdvanced(cuis, countSingle, minConceptFreq, minPosteriorProb, uniFreq, jointFreq);
-      } else {
-	if (method == "NB") {
-	  res = disambiguateNB(cuis, countSingle, minConceptFreq, minPosteriorProb, uniFreq, jointFreq);
-	} else {
-	  cerr << "Error: invalid method id '"<<method<<"' \n";
-	  exit(10);
-	}
+    state.cases.push_back({ itamb->first, itamb->second, -1 });
+  }
+
+  c.features += nowSeconds() - t0;
+
+}
+
 
+/*
+ * Features of case caseNo of the document, built in 'features' from the features of the
+ * document: for both advanced and NB the target CUIs are excluded, cumulatively (the targets of
+ * the previous cases of the document are also excluded). The cases of a document are stored
+ * without their features, since they differ only by these exclusions; if 'features' already
+ * holds an earlier case of the same document (*builtDoc, *builtCaseNo) only the missing targets
+ * are removed. The order of the features is the same as in a copy of the document features.
+ */
+void caseFeatures(DocState &state, size_t caseNo, string &method, unordered_map<string, INT> &features, DocState **builtDoc, size_t *builtCaseNo) {
+
+  int basic = (method == "basic"); // no exclusion: the same features for all the cases
+  size_t from = 0;
+  if ((*builtDoc == &state) && (basic || (*builtCaseNo <= caseNo))) {
+    from = basic ? caseNo + 1 : *builtCaseNo + 1;
+  } else {
+    features = state.features;
+    from = basic ? caseNo + 1 : 0;
+  }
+  for (size_t i=from; i<=caseNo; i++) {
+    for (string &target : state.cases[i].group->cuis) {
+      unordered_map<string, INT>::iterator itRm = features.find(target);
+      if (itRm != features.end()) {
+	features.erase(itRm);
       }
     }
-    disamb.insert({cuisOrIdsStr, res});
   }
+  *builtDoc = &state;
+  *builtCaseNo = caseNo;
+
+}
 
-  for ( it = doc.begin(); it != doc.end(); it++ )  {
+
+void writeDoc(DocState &state, ostream &outFH) {
+
+  string &pmid = state.pmid;
+  unordered_map<string, string>::iterator it;
+  unordered_map<string, TargetGroup *>::iterator itamb;
+  for ( it = state.doc.begin(); it != state.doc.end(); it++ )  {
     string docKey = it->first;
     vector<string> keyParts = split(docKey, ',');
     string cuisOrIdsStr = it->second;
     string newIdsStr;
     totalCases++;
-    itamb = multi.find(cuisOrIdsStr);
-    if (itamb != multi.end()) { // ambiguous case
+    itamb = state.multi.find(cuisOrIdsStr);
+    if (itamb != state.multi.end()) { // ambiguous case
       totalAmbig++;
-      unordered_map<string, vector<string>>::iterator itnew = disamb.find(cuisOrIdsStr);
-      if ((itnew != disamb.end()) && (itnew->second.size()>0)) { // ambiguous fixed
+      unordered_map<string, vector<string>>::iterator itnew = state.disamb.find(cuisOrIdsStr);
+      if ((itnew != state.disamb.end()) && (itnew->second.size()>0)) { // ambiguous fixed
 	ambigFixed++;
 	newIdsStr = join(itnew->second, ",");
       } else {
-	unordered_map<string,string>::iterator itO = originalMulti.find(cuisOrIdsStr);
-	if (itO != originalMulti.end()) {
-	  newIdsStr = itO->second;
-	} else {
-	  cerr << "Bug: can't find key supposed to be in the map\n";
-	  exit(20);
-	}
+	newIdsStr = itamb->second->sortedCuisStr;
       }
     } else {
-      unordered_map<string,string>::iterator itsingle = single.find(cuisOrIdsStr);
-      if (itsingle != single.end()) {
+      unordered_map<string,string>::iterator itsingle = state.single.find(cuisOrIdsStr);
+      if (itsingle != state.single.end()) {
 	newIdsStr = itsingle->second;
       } // else {
 	// this case can happen now when all the cuis have been discarded due to ignoreTargetIfNotInPairsData
@@ -905,9 +2244,346 @@ void processOneDoc(string &pmid, ofstream &outFH, unordered_map<string, string>
       outFH << pmid <<"\t"<< keyParts[0]<<"\t"<< keyParts[1]<<"\t"<< keyParts[2]<<"\t"<< newIdsStr <<"\t"<< keyParts[3] <<"\t"<< keyParts[4]<<  endl;
     }
   }
+
+}
+
+
+/*
+ * Decision store (option -U)
+ *
+ * A line by document: <config> <pmid> <content hash> <decisions>, tab-separated. <config> is the
+ * fingerprint of the parameters, the pairs data and the resources (see decisionStoreFingerprint),
+ * <content hash> the hash of the rows of the document and of its ambiguity cases in order: the
+ * features of a case depend on the previous cases of the document (the targets are excluded),
+ * whose order depends on the hash maps. <decisions> contains '<outcome>:<selected CUI>' for
+ * every case in order, comma-separated (no CUI if the outcome is not success).
+ */
+
+/*
+ * Reads the decisions stored by the previous runs for the configuration config, if the file
+ * exists (the last line wins): the lines of the other configurations are skipped without being
+ * split, so only the decisions usable with the current parameters are in memory.
+ */
+void readDecisionStore(string filename, string &config) {
+
+  unordered_map<string, string>().swap(storedDecisions);
+  ifstream file(filename);
+  if (!file) {
+    return;
+  }
+  string prefix = config + "\t";
+  INT invalid = 0;
+  string str;
+  while (getline(file, str)) {
+    if (str.compare(0, prefix.length(), prefix) != 0) {
+      continue;
+    }
+    size_t pos = str.rfind('\t');
+    if (count(str.begin(), str.end(), '\t') != 3) { // e.g. interrupted run
+      invalid++;
+      continue;
+    }
+    storedDecisions[str.substr(0, pos)] = str.substr(pos+1);
+  }
+  file.close();
+  if (invalid > 0) {
+    cerr << "Warning: "<<invalid<<" invalid lines ignored in decision store '"<<filename<<"'"<<endl;
+  }
+
+}
+
+
+// everything the decisions depend on, apart from the document
+string decisionStoreFingerprint(Disambiguator &d, int compactPairsData, int minMinConceptFreq, uint64_t resources) {
+
+  char probs[100];
+  sprintf(probs, "%.17g\t%.17g", d.minPosteriorProb, minPMI);
+  string config = "kd-decisions-1\t" + d.method + "\t" + to_string(d.minConceptFreq) + "\t" + probs;
+  config += "\t" + to_string(d.ignoreTargetIfNotInPairsData) + "\t" + to_string(d.advancedDiscriminativeFeatsOnly);
+  config += "\t" + to_string(topKNeighbours) + "\t" + to_string(minJointFreq) + "\t" + to_string(compactPairsData);
+  config += "\t" + to_string(minMinConceptFreq) + "\t" + to_string(d.totalNbDocs);
+  config += "\t" + hex64(pairsDataFingerprint) + "\t" + hex64(resources);
+  return hex64(fnv1a(config));
+
+}
+
+
+// fingerprint of the reference file and of the external resource, as loaded
+uint64_t resourcesFingerprint(vector<uint32_t> *idToCui, ExternalResource *r) {
+
+  uint64_t h = FNV1A_OFFSET_BASIS;
+  if (idToCui != NULL) {
+    for (uint32_t id : *idToCui) {
+      h = fnv1a(cuiNames[id] + "\n", h);
+    }
+  }
+  h = fnv1a(string("|"), h);
+  if (r != NULL) {
+    h = fnv1a(r->pmids.data(), r->pmids.size() * sizeof(uint32_t), h);
+    h = fnv1a(r->cuisStart.data(), r->cuisStart.size() * sizeof(uint32_t), h);
+    for (uint32_t id : r->cuiIds) {
+      h = fnv1a(cuiNames[id] + ",", h);
+    }
+  }
+  return h;
+
+}
+
+
+// sets the key of the document, and its decisions if they are in the store
+void reuseStoredDecisions(DocState &state, BatchCounters &c) {
+
+  state.reused = 0;
+  if (state.cases.size() == 0) {
+    return;
+  }
+  uint64_t rowsHash = 0; // the rows in any order
+  for (unordered_map<string, string>::iterator it = state.doc.begin(); it != state.doc.end(); it++) {
+    rowsHash += fnv1a(it->first + "\t" + it->second);
+  }
+  uint64_t h = fnv1a(&rowsHash, sizeof(rowsHash));
+  for (AmbiguityCase &ambCase : state.cases) {
+    h = fnv1a(ambCase.cuisOrIdsStr + ";", h);
+  }
+  state.storeKey = decisionStoreConfig + "\t" + state.pmid + "\t" + hex64(h);
+  c.storeLookups++;
+
+  unordered_map<string, string>::iterator it = storedDecisions.find(state.storeKey);
+  if (it == storedDecisions.end()) {
+    return;
+  }
+  vector<string> decisions = split(it->second, ',');
+  if (decisions.size() != state.cases.size()) {
+    return;
+  }
+  for (string &decision : decisions) {
+    if ((decision.length() < 2) || (decision[0] < '0') || (decision[0] > '3') || (decision[1] != ':')) {
+      return;
+    }
+  }
+  for (size_t caseNo=0; caseNo<decisions.size(); caseNo++) {
+    AmbiguityCase &ambCase = state.cases[caseNo];
+    Decision decision = makeDecision(decisions[caseNo][0] - '0', -1, -1);
+    vector<string> res;
+    if (decision.outcome == OUTCOME_SUCCESS) {
+      res.push_back(decisions[caseNo].substr(2));
+    }
+    state.disamb.insert({ambCase.cuisOrIdsStr, res});
+    ambCase.outcome = decision.outcome;
+    countDecision(decision, c);
+  }
+  state.reused = 1;
+  c.storeReused++;
+  c.storeReusedCases += decisions.size();
+
+}
+
+
+void writeStoredDecisions(DocState &state, ostream &outFH) {
+
+  outFH << state.storeKey << "\t";
+  for (size_t caseNo=0; caseNo<state.cases.size(); caseNo++) {
+    AmbiguityCase &ambCase = state.cases[caseNo];
+    outFH << ((caseNo>0) ? "," : "") << ambCase.outcome << ":";
+    if (ambCase.outcome == OUTCOME_SUCCESS) {
+      outFH << state.disamb[ambCase.cuisOrIdsStr][0];
+    }
+  }
+  outFH << "\n";
+
+}
+
+
+// resolves and scores the ambiguity cases of the batch (can be called by several threads at once)
+void processBatch(Batch &batch, unordered_map<string, TargetGroup> &targetGroupsCache, Disambiguator &disamb, vector<uint32_t> *idToCui, ExternalResource *externalCuisByPMid) {
+
+  BatchCounters &counters = batch.counters;
+  for (DocState &state : batch.docs) {
+    collectDocCases(state, counters, targetGroupsCache, disamb.minConceptFreq, idToCui, disamb.uniFreq, externalCuisByPMid);
+    if (decisionStoreFH != NULL) {
+      reuseStoredDecisions(state, counters);
+    }
+  }
+  Disambiguator fullDisamb = disamb; // option -R, always with the hash maps
+  fullDisamb.jointFreq = fullJointFreq;
+  fullDisamb.packedJointFreq = NULL;
+  DisambiguationEngine engine = selectDisambiguationEngine(disamb);
+
+  // cases grouped by target group, the groups in order of first occurrence
+  unordered_map<TargetGroup *, size_t> groupNoByGroup;
+  vector<vector<pair<size_t, size_t>>> casesByGroup; // (doc no, case no)
+  for (size_t docNo=0; docNo<batch.docs.size(); docNo++) {
+    if (batch.docs[docNo].reused) {
+      continue;
+    }
+    for (size_t caseNo=0; caseNo<batch.docs[docNo].cases.size(); caseNo++) {
+      unordered_map<TargetGroup *, size_t>::iterator it = groupNoByGroup.insert({batch.docs[docNo].cases[caseNo].group, casesByGroup.size()}).first;
+      if (it->second == casesByGroup.size()) {
+	casesByGroup.push_back(vector<pair<size_t, size_t>>());
+      }
+      casesByGroup[it->second].push_back({docNo, caseNo});
+    }
+  }
+
+  unordered_map<string, INT> features; // of the current case
+  DocState *builtDoc = NULL;
+  size_t builtCaseNo = 0;
+  for (vector<pair<size_t, size_t>> &groupCases : casesByGroup) {
+    NBTable *nbTable = NULL;
+    NBTable *fullNbTable = NULL;
+    DisambiguationFunction disambiguate = engineFunctionFor(engine, batch.docs[groupCases[0].first].cases[groupCases[0].second].group->cuis.size());
+    for (pair<size_t, size_t> &c : groupCases) {
+      DocState &state = batch.docs[c.first];
+      AmbiguityCase &ambCase = state.cases[c.second];
+      vector<string> &cuis = ambCase.group->cuis;
+      double tFeatures = nowSeconds();
+      caseFeatures(state, c.second, disamb.method, features, &builtDoc, &builtCaseNo);
+      double tCall = nowSeconds();
+      counters.features += tCall - tFeatures;
+      Decision decision = disambiguate(disamb, cuis, features, &nbTable);
+      double callSeconds = nowSeconds() - tCall;
+      addScoringTime(callSeconds, counters);
+      if (hotGroupsTopN > 0) {
+	profileGroup(ambCase.group, decision, callSeconds, disamb.jointFreq);
+      }
+      if (equivalenceFH != NULL) {
+	checkEquivalence(state.pmid, disamb.method, cuis, features, decision, legacyDisambiguate(disamb.method, cuis, features, disamb.minConceptFreq, disamb.minPosteriorProb, disamb.uniFreq, legacyJointFreq), counters);
+      }
+      if (fullJointFreq != NULL) {
+	compareWithFullData(decision, disambiguate(fullDisamb, cuis, features, &fullNbTable), counters);
+      }
+      countDecision(decision, counters);
+      ambCase.outcome = decision.outcome;
+      vector<string> res;
+      if (decision.outcome == OUTCOME_SUCCESS) {
+	res.push_back(cuis[decision.targetNo]);
+      }
+      state.disamb.insert({ambCase.cuisOrIdsStr, res});
+    }
+    if (nbTable != NULL) {
+      double tFree = nowSeconds();
+      freeNBTable(nbTable);
+      counters.scoring += nowSeconds() - tFree;
+    }
+    if (fullNbTable != NULL) {
+      freeNBTable(fullNbTable);
+    }
+  }
+
+}
+
+
+// writes the documents of the batch in order and updates the global counters (called by a single thread)
+void writeBatch(Batch &batch, OutputFile &outFile) {
+
+  double t1 = nowSeconds();
+  size_t batchBytes = 0;
+  ostringstream outFH;
+  for (DocState &state : batch.docs) {
+    writeDoc(state, outFH);
+    if ((decisionStoreFH != NULL) && !state.reused && (state.cases.size()>0)) {
+      writeStoredDecisions(state, *decisionStoreFH);
+    }
+    batchBytes += hashMapBytes(state.doc) + hashMapBytes(state.single) + hashMapBytes(state.multi) + hashMapBytes(state.disamb) + hashMapBytes(state.features);
+    for (AmbiguityCase &ambCase : state.cases) {
+      batchBytes += heapBytes(ambCase.cuisOrIdsStr);
+    }
+  }
+  writeOutput(outFile, outFH.str());
+  timing.writing += nowSeconds() - t1;
+  if (batchBytes > memory.perDocPeak) {
+    memory.perDocPeak = batchBytes;
+  }
+  mergeBatchCounters(batch.counters);
+
+}
+
+
+/*
+ * Pipeline for processing a file with several threads (option -t): the reader (the calling
+ * thread) submits the batches in order, the workers process them and the writer writes them
+ * in the same order. The number of batches in the pipeline is bounded so that the reader waits
+ * when the workers or the writer are behind.
+ */
+struct BatchPipeline {
+  mutex m;
+  condition_variable workAvailable;
+  condition_variable batchDone;
+  condition_variable slotAvailable;
+  deque<pair<size_t, Batch *>> todo;
+  map<size_t, Batch *> done;
+  size_t submitted;
+  size_t written;
+  size_t maxBatches;
+  int closed;
+  function<void(Batch &, int)> process; // batch, worker no
+  function<void(Batch &)> write;
+};
+
+
+void pipelineWorker(BatchPipeline *p, int workerNo) {
+  unique_lock<mutex> lock(p->m);
+  while (1) {
+    p->workAvailable.wait(lock, [p] { return (p->todo.size()>0) || p->closed; });
+    if (p->todo.size()==0) {
+      return;
+    }
+    pair<size_t, Batch *> job = p->todo.front();
+    p->todo.pop_front();
+    lock.unlock();
+    p->process(*job.second, workerNo);
+    lock.lock();
+    p->done.insert(job);
+    p->batchDone.notify_all();
+  }
+}
+
+
+void pipelineWriter(BatchPipeline *p) {
+  unique_lock<mutex> lock(p->m);
+  while (1) {
+    p->batchDone.wait(lock, [p] { return (p->done.count(p->written)>0) || (p->closed && (p->written == p->submitted)); });
+    map<size_t, Batch *>::iterator it = p->done.find(p->written);
+    if (it == p->done.end()) {
+      return;
+    }
+    Batch *batch = it->second;
+    p->done.erase(it);
+    lock.unlock();
+    p->write(*batch);
+    delete batch;
+    lock.lock();
+    p->written++;
+    p->slotAvailable.notify_all();
+  }
+}
+
+
+void pipelineSubmit(BatchPipeline *p, Batch *batch) {
+  unique_lock<mutex> lock(p->m);
+  p->slotAvailable.wait(lock, [p] { return p->submitted - p->written < p->maxBatches; });
+  p->todo.push_back({p->submitted, batch});
+  p->submitted++;
+  p->workAvailable.notify_one();
+}
+
+
+void pipelineClose(BatchPipeline *p) {
+  lock_guard<mutex> lock(p->m);
+  p->closed = 1;
+  p->workAvailable.notify_all();
+  p->batchDone.notify_all();
 }
 
-void processFile(string &dataFile, string &method, int minConceptFreq, double minPosteriorProb, unordered_map<INT, string> *idToCui,  unordered_map<string, INT>* uniFreq, unordered_map<string, unordered_map<string, INT>*> *jointFreq, string outputDir, unordered_map<string, vector<string>> *externalCuisByPMid) {
+
+
+// the input files are read in order through 'input' (see async-io.h), this is file 'fileNo'
+void processFile(InputPrefetcher *input, int fileNo, Disambiguator &disamb, vector<uint32_t> *idToCui, string outputDir, ExternalResource *externalCuisByPMid, unordered_set<string> *nonLatestPmidVersions) {
+
+  string &dataFile = input->files[fileNo];
+  string &method = disamb.method;
+  int minConceptFreq = disamb.minConceptFreq;
+  double minPosteriorProb = disamb.minPosteriorProb;
 
   const string suffix = ".out.cuis";
   if (dataFile.substr(dataFile.length()-suffix.length(), suffix.length()) !=  suffix) {
@@ -917,29 +2593,74 @@ void processFile(string &dataFile, string &method, int minConceptFreq, double mi
   string baseFile = string(basename(strdup(dataFile.c_str())));
   string outputFile = outputDir+"/"+baseFile;
   
-  ofstream outFH;
-  outFH.open(outputFile);
-  if (!outFH) {
+  OutputFile outFile;
+  if (!openOutputFile(outFile, outputFlusher, outputFile)) {
     cerr << "Error opening "<< outputFile << endl;
     exit(1);
   }
 
-  ifstream inFH(dataFile);
-  if (!inFH) {
+  LineReader inFH;
+  if (openLineReader(inFH, input, fileNo) != 0) {
     cerr << "Error opening "<< dataFile << endl;
     exit(1);
   }
 
+  string jsonFile = outputDir+".stats.json";
+  vector<Disambiguator> workerDisamb(nbThreads, disamb); // option -H 'replicate': the copy of the pairs data of the node of the worker
+  for (int workerNo=0; workerNo<nbThreads; workerNo++) {
+    if (!packedReplicas.empty()) {
+      workerDisamb[workerNo].packedJointFreq = packedReplicas[workerNo % packedReplicas.size()];
+    }
+  }
+  function<void(Batch &, int)> process = [&](Batch &batch, int workerNo) {
+    processBatch(batch, targetGroupsCaches[workerNo], workerDisamb[workerNo], idToCui, externalCuisByPMid);
+  };
+  function<void(Batch &)> write = [&](Batch &batch) {
+    writeBatch(batch, outFile);
+    if ((statsJsonDumpPeriod > 0) && (nowSeconds() - timing.lastJsonDump >= statsJsonDumpPeriod)) {
+      writeStatsJson(jsonFile, method, minConceptFreq, minPosteriorProb, dataFile);
+    }
+  };
+  BatchPipeline pipeline;
+  vector<thread> threads;
+  if (nbThreads > 1) {
+    pipeline.submitted = 0;
+    pipeline.written = 0;
+    pipeline.maxBatches = 4 * nbThreads;
+    pipeline.closed = 0;
+    pipeline.process = process;
+    pipeline.write = write;
+    for (int workerNo=0; workerNo<nbThreads; workerNo++) {
+      threads.push_back(thread(pipelineWorker, &pipeline, workerNo));
+      if (pinWorkers) {
+	pinThreadToNode(threads.back().native_handle(), numaNodesList[workerNo % numaNodesList.size()]);
+      }
+    }
+    threads.push_back(thread(pipelineWriter, &pipeline));
+  } else if (pinWorkers && !packedReplicas.empty()) {
+    pinThreadToNode(pthread_self(), numaNodesList[0]); // single thread: on the node of the first copy
+  }
+
   unordered_map<string,string> dataOneDoc;
+  Batch *batch = new Batch();
+  batch->counters = {};
   string lastPMID;
   string str; 
-  while (getline(inFH, str)) {
+  while (readLine(inFH, str)) {
+    batch->counters.rows++;
     vector<string> cols = split(str,'\t');
     if (cols.size() != 7) {
       cerr << "Error: expecting 7 columns in '"<<dataFile<<"'\n";
       exit(5);
     }
     string pmid = cols[0];
+    if (nonLatestPmidVersions != NULL) { // on the fly deduplication: discard non-latest versions, then '<pmid>.<version>' -> '<pmid>'
+      if (nonLatestPmidVersions->find(pmid) != nonLatestPmidVersions->end()) {
+	totalDiscardedNonLatestVersion++;
+	continue;
+      }
+      pmid = pmid.substr(0, pmid.find('.'));
+    }
     string docType = cols[1];
     string docId = cols[2];
     string sentNo = cols[3];
@@ -949,26 +2670,62 @@ void processFile(string &dataFile, string &method, int minConceptFreq, double mi
     string docKey = docType+","+docId+","+sentNo+","+pos+","+length;
 
     if ( (lastPMID.length()>0) && (lastPMID != pmid)) {
-      processOneDoc(lastPMID, outFH, dataOneDoc, method, minConceptFreq, minPosteriorProb, idToCui, uniFreq, jointFreq, externalCuisByPMid);
+      batch->docs.push_back(DocState());
+      batch->docs.back().pmid = lastPMID;
+      batch->docs.back().doc = dataOneDoc; // copy: same buckets, hence same order of the rows in the output
       dataOneDoc.clear();
+      if (batch->docs.size() >= batchSize) {
+	if (nbThreads > 1) {
+	  pipelineSubmit(&pipeline, batch);
+	} else {
+	  process(*batch, 0);
+	  write(*batch);
+	  delete batch;
+	}
+	batch = new Batch();
+	batch->counters = {};
+      }
     }
     dataOneDoc.insert({ docKey, cuisOrIds });
     lastPMID = pmid;
   }
   if (lastPMID.length()>0) {
-    processOneDoc(lastPMID, outFH, dataOneDoc, method, minConceptFreq, minPosteriorProb, idToCui, uniFreq, jointFreq, externalCuisByPMid);
+    batch->docs.push_back(DocState());
+    batch->docs.back().pmid = lastPMID;
+    batch->docs.back().doc = dataOneDoc;
   }
-  inFH.close();
-  outFH.close();
+  // the last batch can contain only the number of rows
+  if (nbThreads > 1) {
+    pipelineSubmit(&pipeline, batch);
+    pipelineClose(&pipeline);
+    for (thread &t : threads) {
+      t.join();
+    }
+  } else {
+    process(*batch, 0);
+    write(*batch);
+    delete batch;
+  }
+  closeLineReader(inFH);
+  closeOutputFile(outFile);
+  timing.inputWait += inFH.waitSeconds;
+  timing.outputWait += outFile.waitSeconds;
+  if (decisionStoreFH != NULL) {
+    decisionStoreFH->flush();
+  }
+  timing.files++;
 
   string statsOutputFile = outputDir+".stats";
-  outFH.open(statsOutputFile);
+  ofstream outFH(statsOutputFile);
   if (!outFH) {
     cerr << "Error opening "<< statsOutputFile << endl;
     exit(1);
   }
 
   outFH << "\nTotal: "<<totalCases<<endl;
+  if (nonLatestPmidVersions != NULL) {
+    outFH << "Discarded non-latest PMID versions (option -D): "<<totalDiscardedNonLatestVersion<<endl;
+  }
   outFH << "Discarded (if option -d): "<<totalDiscardedDueToNotInPairsData<<"  ("<<strProp(totalDiscardedDueToNotInPairsData,totalCases)<<" %)" <<endl;
   outFH << "Ambiguous: "<<totalAmbig<<" ("<<strProp(totalAmbig,totalCases)<<" %)"<<endl;
   outFH << "Ambiguous fixed: "<<ambigFixed<<"  ("<<strProp(ambigFixed,totalAmbig)<<" %)"<<endl;
@@ -977,10 +2734,37 @@ void processFile(string &dataFile, string &method, int minConceptFreq, double mi
   outFH <<  "  Failed - Unknown target: "<<uniqueUnknownTarget<<" ("<<strProp(uniqueUnknownTarget,uniqueTotalCases)<<" %)\n";
   outFH <<  "  Failed - Method Not Applicable: "<<uniqueMethodNA<<" ("<<strProp(uniqueMethodNA,uniqueTotalCases)<<" %)\n";
   outFH <<  "  Failed - Rejected due to threshold: "<<uniqueThrehsholdReject<<" ("<<strProp(uniqueThrehsholdReject,uniqueTotalCases)<<" %)\n\n";
+  if (decisionStoreFH != NULL) {
+    outFH << "Decision store (option -U): "<<decisionStoreLookups<<" documents with ambiguity cases\n";
+    outFH <<  "  Reused: "<<decisionStoreReused<<" ("<<strProp(decisionStoreReused,decisionStoreLookups)<<" %)\n";
+    outFH <<  "  Unique ambiguity cases reused: "<<decisionStoreReusedCases<<" ("<<strProp(decisionStoreReusedCases,uniqueTotalCases)<<" %)\n\n";
+  }
+  if (equivalenceFH != NULL) {
+    outFH << "Equivalence check with legacy implementation (option -X): "<<equivalenceChecked<<" cases\n";
+    outFH <<  "  Different: "<<equivalenceMismatches<<" ("<<strProp(equivalenceMismatches,equivalenceChecked)<<" %)\n";
+    outFH <<  "  Different but explained by tolerance: "<<equivalenceExplained<<" ("<<strProp(equivalenceExplained,equivalenceChecked)<<" %)\n\n";
+  }
+  if (fullJointFreq != NULL) {
+    printTruncationReport(outFH);
+  }
+  accountTargetGroupsCache();
+  outFH << "Memory (approximate bytes):\n";
+  printMemoryBreakdown(outFH);
+  outFH << "\n";
+  if (pairsPlacement.length()>0) {
+    outFH << "Pairs data placement (option -H): '"<<pairsPlacement<<"', "<<numaNodesList.size()<<" NUMA nodes"<<(pinWorkers ? ", worker threads pinned" : "")<<"\n  ";
+    printPlacement(outFH);
+    outFH << "\n";
+  }
 
   
 
   outFH.close();
+
+  writeStatsJson(statsOutputFile+".json", method, minConceptFreq, minPosteriorProb, "");
+  if (hotGroupsTopN > 0) {
+    writeHotGroups(outputDir+".hot-groups.tsv");
+  }
 }
 
 
@@ -989,18 +2773,21 @@ void processFile(string &dataFile, string &method, int minConceptFreq, double mi
 int main(int argc, char **argv) {
 
   string cuiRefFile;
+  string nbKernelName;
+  int compactPairsData = 0;
   //  int inputAsFile=0;
   int multiParameterValues=0;
 
-  unordered_map<INT, string> *idToCui = NULL;
-  unordered_map<string, INT>* uniFreq  = new unordered_map<string, INT>();
-  unordered_map<string, unordered_map<string, INT>*> *jointFreq  = new unordered_map<string, unordered_map<string, INT>*>();
+  vector<uint32_t> *idToCui = NULL;
+  initPairsStore(pairsStore);
+  unordered_map<string, INT>* uniFreq  = &pairsStore.uniFreq;
+  unordered_map<string, unordered_map<string, INT>*> *jointFreq  = &pairsStore.jointFreq;
 
   
 
   int option;
   // put ':' at the starting of the string so compiler can distinguish between '?' and ':'
-  while((option = getopt(argc, argv, ":hr:f:b:a:dAMe:")) != -1){ //get option from the getopt() method
+  while((option = getopt(argc, argv, ":hr:f:b:a:dAMe:E:D:T:X:S:P:K:W:t:k:j:i:RCU:H:I:")) != -1){ //get option from the getopt() method
     switch(option){
       //For option i, r, l, print that these are options
     case 'h':
@@ -1032,6 +2819,66 @@ int main(int argc, char **argv) {
     case 'e':
       externalCuisByPmidOpts = split(optarg, ':');
       break;
+    case 'E':
+      externalCuisSnapshotFile = optarg;
+      break;
+    case 'D':
+      nonLatestPmidVersionsFile = optarg;
+      break;
+    case 'T':
+      statsJsonDumpPeriod = atof(optarg);
+      break;
+    case 'X':
+      equivalenceTolerance = atof(optarg);
+      break;
+    case 'S':
+      memoryEstimateSamplingRate = atof(optarg);
+      break;
+    case 'P':
+      hotGroupsTopN = atoi(optarg);
+      break;
+    case 'K':
+      nbKernelName = optarg;
+      break;
+    case 'W':
+      batchSize = max(atoi(optarg), 1);
+      break;
+    case 't':
+      nbThreads = max(atoi(optarg), 1);
+      targetGroupsCaches.resize(nbThreads);
+      break;
+    case 'k':
+      topKNeighbours0 = optarg;
+      break;
+    case 'j':
+      minJointFreq = strtol(optarg, NULL, 10);
+      break;
+    case 'i':
+      minPMI = atof(optarg);
+      break;
+    case 'R':
+      truncationReport = 1;
+      break;
+    case 'C':
+      compactPairsData = 1;
+      break;
+    case 'U':
+      decisionStoreFile = optarg;
+      break;
+    case 'H':
+      pairsPlacement = optarg;
+      if (pairsPlacement.compare(0, 10, "replicate:") == 0) {
+	replicatedPercent = atof(pairsPlacement.c_str()+10);
+	pairsPlacement = "replicate";
+	if ((replicatedPercent < 0) || (replicatedPercent > 100)) {
+	  cerr << "Error: option -H 'replicate:<percent>', the percentage must be between 0 and 100."<<endl;
+	  exit(1);
+	}
+      }
+      break;
+    case 'I':
+      ioReadAheadChunks = atoi(optarg);
+      break;
     case ':':
       printf("option needs a value\n");
       break;
@@ -1041,6 +2888,12 @@ int main(int argc, char **argv) {
     }
   }
 
+  nbKernel = selectNBKernel(nbKernelName.length()>0 ? nbKernelName.c_str() : NULL);
+  if ((nbKernelName.length()>0) && (nbKernelName != nbKernel.name)) {
+    cerr << "Error: NB kernel '"<<nbKernelName<<"' not available, the best available is '"<<nbKernel.name<<"'"<<endl;
+    exit(1);
+  }
+
   if (argc != optind+3) {
     cerr << "Error, 3 arguments required."<<endl;
     usage(cerr);
@@ -1066,12 +2919,58 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (!multiParameterValues && ((methods.size()>1) || (minConceptFreqs.size()>1) || (minPosteriorProbs.size()>1) ) ) {
+  // top-K values in decreasing order, since the truncation is done in place
+  vector<INT> topKs;
+  if (topKNeighbours0.length()>0) {
+    for (string val : split(topKNeighbours0,':')) {
+      topKs.push_back(max(strtol(val.c_str(), NULL, 10), 1L));
+    }
+    sort(topKs.rbegin(), topKs.rend());
+  } else {
+    topKs.push_back(0);
+  }
+  int truncation = (topKNeighbours0.length()>0) || (minJointFreq > 0) || (minPMI > -INFINITY);
+  if (truncationReport && !truncation) {
+    cerr << "Error: option -R requires -k, -j or -i."<<endl;
+    exit(1);
+  }
+
+  if (compactPairsData && (topKs.size()>1)) {
+    cerr << "Error: option -C cannot be used with several values for -k."<<endl;
+    exit(1);
+  }
+
+  if ((pairsPlacement.length()>0) && (!compactPairsData || ((pairsPlacement != "huge") && (pairsPlacement != "interleave") && (pairsPlacement != "replicate")))) {
+    cerr << "Error: option -H requires -C, the placement must be 'huge', 'interleave' or 'replicate'."<<endl;
+    exit(1);
+  }
+
+  if ((decisionStoreFile.length()>0) && (truncationReport || (equivalenceTolerance >= 0))) {
+    cerr << "Error: option -U cannot be used with -R or -X."<<endl;
+    exit(1);
+  }
+
+  if (!multiParameterValues && ((methods.size()>1) || (minConceptFreqs.size()>1) || (minPosteriorProbs.size()>1) || (topKs.size()>1) ) ) {
     cerr << "Error: must use -m with multiple parameters values."<<endl;
     exit(1);
   }
 
+  for (string method : methods) {
+    if (!validDisambiguationMethod(method)) {
+      cerr << "Error: invalid method id '"<<method<<"' \n";
+      exit(10);
+    }
+  }
+
+  int loadPairs = multiParameterValues || (method0 == "NB") || (method0 == "advanced");
+  if (memoryEstimateSamplingRate > 0) {
+    estimateMemory(memoryEstimateSamplingRate, pairsStatsFile, loadPairs, minMinConceptFreq, topKs[0], compactPairsData, cuiRefFile, nonLatestPmidVersionsFile);
+    exit(0);
+  }
+
   createDirIfNeeded(outputDir.c_str());
+  outputFlusher = new OutputFlusher();
+  startOutputFlusher(outputFlusher, ioReadAheadChunks * IO_CHUNK_BYTES);
 
   vector<string> dataFiles;
   string str; 
@@ -1085,15 +2984,33 @@ int main(int argc, char **argv) {
 
   if (cuiRefFile.length()>0) {
     cerr << "Reading reference file '" << cuiRefFile<<"'" <<endl;
+    double t0 = nowSeconds();
     idToCui = readCuiRefFile(cuiRefFile);
+    timing.loadRefFile = nowSeconds() - t0;
   }
 
-  unordered_map<string, vector<string>> *externalCuisByPMid = NULL;
+  ExternalResource *externalCuisByPMid = NULL;
+  double t0 = nowSeconds();
+  if ((externalCuisByPmidOpts.size()>0) && (externalCuisByPmidOpts.size() != 4)) {
+    cerr << "Error: format error in option -e"<<endl;
+    exit(8);
+  }
+  string externalSource; // empty without -e: the snapshot is used as is
   if (externalCuisByPmidOpts.size()>0) {
-    if (externalCuisByPmidOpts.size() != 4) {
-      cerr << "Error: format error in option -e"<<endl;
-      exit(8);
+    externalSource = externalResourceSource(externalCuisByPmidOpts[0], atoi(externalCuisByPmidOpts[1].c_str()), atoi(externalCuisByPmidOpts[2].c_str()), externalCuisByPmidOpts[3].at(0));
+  }
+  if (externalCuisSnapshotFile.length()>0) {
+    externalCuisByPMid = readExternalResourceSnapshot(externalCuisSnapshotFile, externalSource);
+    if (externalCuisByPMid != NULL) {
+      cerr << "Read external CUIs from snapshot '" << externalCuisSnapshotFile <<"'" <<endl;
+    } else {
+      if (externalCuisByPmidOpts.size()==0) {
+	cerr << "Error: option -E requires -e if the snapshot file does not exist"<<endl;
+	exit(8);
+      }
     }
+  }
+  if ((externalCuisByPMid == NULL) && (externalCuisByPmidOpts.size()>0)) {
     string &filename = externalCuisByPmidOpts[0];
     int colPMIDNo = atoi(externalCuisByPmidOpts[1].c_str()); 
     int colCuisNo = atoi(externalCuisByPmidOpts[2].c_str());
@@ -1101,40 +3018,161 @@ int main(int argc, char **argv) {
 
     cerr << "Reading external CUIs  file '" << filename <<"'" <<endl;
     externalCuisByPMid = readExternalResource(filename, colPMIDNo, colCuisNo, separator);
+    if (externalCuisSnapshotFile.length()>0) {
+      cerr << "Writing external CUIs snapshot '" << externalCuisSnapshotFile <<"'" <<endl;
+      writeExternalResourceSnapshot(externalCuisSnapshotFile, externalCuisByPMid, externalSource);
+    }
  }
+  timing.loadExternal = nowSeconds() - t0;
+
+  unordered_set<string> *nonLatestPmidVersions = NULL;
+  if (nonLatestPmidVersionsFile.length()>0) {
+    cerr << "Reading non-latest PMID versions file '" << nonLatestPmidVersionsFile <<"'" <<endl;
+    t0 = nowSeconds();
+    nonLatestPmidVersions = readNonLatestPmidVersions(nonLatestPmidVersionsFile);
+    timing.loadNonLatest = nowSeconds() - t0;
+  }
+
+  uint64_t resources = 0;
+  if (decisionStoreFile.length()>0) {
+    decisionStoreFH = new ofstream(decisionStoreFile, ios::app);
+    if (!*decisionStoreFH) {
+      cerr << "Error opening "<< decisionStoreFile << endl;
+      exit(1);
+    }
+    resources = resourcesFingerprint(idToCui, externalCuisByPMid);
+  }
 
 
   
-  if (multiParameterValues || (method0 == "NB") || (method0 == "advanced") ) {
+  if (loadPairs) {
     cerr << "Reading pairs stats file '" << pairsStatsFile <<"'" <<endl;
-    readPairsData(pairsStatsFile, uniFreq, jointFreq, minMinConceptFreq);
+    t0 = nowSeconds();
+    if (truncationReport) {
+      fullJointFreq = new unordered_map<string, unordered_map<string, INT>*>();
+    }
+    // hash maps: truncated below for every value of -k
+    PairsStoreOptions options = pairsStoreOptions(minMinConceptFreq, compactPairsData ? topKs[0] : 0, compactPairsData);
+    if (pairsPlacement.length()>0) {
+      setPairsPlacement(pairsPlacement, options);
+    }
+    string error;
+    if (!loadPairsStore(pairsStore, pairsStatsFile, options, error)) {
+      cerr << error << endl;
+      exit(1);
+    }
+    if (pairsPlacement.length()>0) {
+      cerr << "Pairs data placement '"<<pairsPlacement<<"': "<<numaNodesList.size()<<" NUMA nodes; ";
+      printPlacement(cerr);
+    }
+    legacyJointFreq = jointFreq;
+    if (compactPairsData && (truncationReport || (equivalenceTolerance >= 0))) {
+      cerr << "Reading pairs stats file '" << pairsStatsFile <<"' as hash maps (options -X, -R)" <<endl;
+      initPairsStore(legacyPairsStore);
+      legacyPairsStore.fullJointFreq = fullJointFreq;
+      PairsStoreOptions legacyOptions = pairsStoreOptions(minMinConceptFreq, topKs[0], 0);
+      legacyOptions.fingerprint = NULL;
+      if (!loadPairsStore(legacyPairsStore, pairsStatsFile, legacyOptions, error)) {
+	cerr << error << endl;
+	exit(1);
+      }
+      legacyJointFreq = &legacyPairsStore.jointFreq;
+    }
+    timing.loadPairs = nowSeconds() - t0;
+    if (fullJointFreq != NULL) {
+      fullJointFreqEntries = countJointFreqEntries(fullJointFreq, NULL);
+    }
   }
+  accountLoadedResources(uniFreq, jointFreq, idToCui, externalCuisByPMid, nonLatestPmidVersions);
 
 
-  for (string method : methods) {
-    for (string minConceptFreqStr : minConceptFreqs) {
-      int minConceptFreq = atoi(minConceptFreqStr.c_str());
-      for (string minPosteriorProbStr : minPosteriorProbs) {
-	resetStatsCase();
-	double minPosteriorProb = atof(minPosteriorProbStr.c_str());
-	cerr << "Processing method="<<method<<"; minConceptFreq="<<minConceptFreq<<"; minPosteriorProb="<<minPosteriorProb<<"...\n";
-	string thisOutputDir = outputDir;
-	if (multiParameterValues)  {
-	  thisOutputDir = outputDir+"/"+method+"_"+ minConceptFreqStr+"_"+minPosteriorProbStr;
-	  createDirIfNeeded(thisOutputDir.c_str());
-	}
-
+  int truncationSummaryLines = 0;
+  for (INT topK : topKs) {
+    topKNeighbours = topK;
+    if (loadPairs && (topK > 0) && !compactPairsData) {
+      cerr << "Truncating pairs data to the top "<<topK<<" co-occurring CUIs..."<<endl;
+      truncateJointFreq(jointFreq, topK);
+      accountLoadedResources(uniFreq, jointFreq, idToCui, externalCuisByPMid, nonLatestPmidVersions);
+    }
+    jointFreqEntries = countJointFreqEntries(jointFreq, packedJointFreq);
+    for (string method : methods) {
+      for (string minConceptFreqStr : minConceptFreqs) {
+	int minConceptFreq = atoi(minConceptFreqStr.c_str());
+	for (string minPosteriorProbStr : minPosteriorProbs) {
+	  resetStatsCase();
+	  double minPosteriorProb = atof(minPosteriorProbStr.c_str());
+	  Disambiguator disamb;
+	  initDisambiguator(disamb, uniFreq, jointFreq, totalNbDocs);
+	  disamb.packedJointFreq = packedJointFreq;
+	  disamb.cuiIdByName = &pairsCuiIdByName;
+	  disamb.cuiNames = &pairsCuiNames;
+	  disamb.uniFreqById = &pairsUniFreqById;
+	  disamb.method = method;
+	  disamb.minConceptFreq = minConceptFreq;
+	  disamb.minPosteriorProb = minPosteriorProb;
+	  disamb.ignoreTargetIfNotInPairsData = ignoreTargetIfNotInPairsData;
+	  disamb.advancedDiscriminativeFeatsOnly = advancedDiscriminativeFeatsOnly;
+	  disamb.minFreqThresholdDone = minFreqThresholdDone;
+	  disamb.nbKernel = nbKernel;
+	  if (decisionStoreFH != NULL) {
+	    decisionStoreConfig = decisionStoreFingerprint(disamb, compactPairsData, minMinConceptFreq, resources);
+	    cerr << "Reading decision store '" << decisionStoreFile <<"' for configuration "<<decisionStoreConfig<<endl;
+	    readDecisionStore(decisionStoreFile, decisionStoreConfig);
+	    memory.decisionStore = hashMapBytes(storedDecisions);
+	  }
+	  cerr << "Processing method="<<method<<"; minConceptFreq="<<minConceptFreq<<"; minPosteriorProb="<<minPosteriorProb<<"...\n";
+	  string thisOutputDir = outputDir;
+	  if (multiParameterValues)  {
+	    thisOutputDir = outputDir+"/"+method+"_"+ minConceptFreqStr+"_"+minPosteriorProbStr;
+	    if (topK > 0) {
+	      thisOutputDir += "_k"+to_string(topK);
+	    }
+	    createDirIfNeeded(thisOutputDir.c_str());
+	  }
+	  if (equivalenceTolerance >= 0) {
+	    string f = thisOutputDir+".equivalence.tsv";
+	    equivalenceFH = new ofstream(f);
+	    if (!*equivalenceFH) {
+	      cerr << "Error opening "<< f << endl;
+	      exit(1);
+	    }
+	    *equivalenceFH << "pmid\tmethod\ttargets\toutcome\tcui\tposterior\tlegacyOutcome\tlegacyCui\tlegacyPosterior\texplained\tfeatures\n";
+	    *equivalenceFH << setprecision(17);
+	  }
 
-	for (int fileNo=0; fileNo<dataFiles.size(); fileNo++) {
-	  string dataFile = dataFiles[fileNo];
-	  cerr << "\rProcessing data file '"<<dataFile<<"' [ "<<fileNo<<" / "<<dataFiles.size()<<" ] ... ";
-	  processFile(dataFile, method, minConceptFreq, minPosteriorProb, idToCui, uniFreq, jointFreq, thisOutputDir, externalCuisByPMid);
+	  InputPrefetcher input;
+	  startInputPrefetcher(&input, dataFiles, ioReadAheadChunks);
+	  for (int fileNo=0; fileNo<dataFiles.size(); fileNo++) {
+	    string dataFile = dataFiles[fileNo];
+	    cerr << "\rProcessing data file '"<<dataFile<<"' [ "<<fileNo<<" / "<<dataFiles.size()<<" ] ... ";
+	    processFile(&input, fileNo, disamb, idToCui, thisOutputDir, externalCuisByPMid, nonLatestPmidVersions);
+	  }
+	  stopInputPrefetcher(&input);
+	  if (equivalenceFH != NULL) {
+	    equivalenceFH->close();
+	    delete equivalenceFH;
+	    equivalenceFH = NULL;
+	  }
+	  if (fullJointFreq != NULL) {
+	    writeTruncationSummary(outputDir+".truncation.tsv", truncationSummaryLines==0, method, minConceptFreq, minPosteriorProb);
+	    truncationSummaryLines++;
+	  }
+	  cerr <<endl;
 	}
-	cerr <<endl;
       }
     }
   }
+  stopOutputFlusher(outputFlusher);
+  delete outputFlusher;
+  if (decisionStoreFH != NULL) {
+    decisionStoreFH->close();
+    delete decisionStoreFH;
+  }
+  if (legacyJointFreq != jointFreq) {
+    legacyPairsStore.fullJointFreq = NULL; // owned by pairsStore
+    freePairsStore(legacyPairsStore);
+  }
+  freePairsStore(pairsStore);
 
-  
 }
 
@@ -0,0 +1,285 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Carp;
+use Getopt::Std;
+
+my $progNamePrefix = "generate-synthetic-kd-data";
+my $progname = "$progNamePrefix.pl";
+
+my $seed = 1;
+my $nbDocs = 10000;
+my $nbFiles = 10;
+my $nbCuis = 50000;
+my $nbAmbigGroups = 5000;
+my $ambigRate = 0.3;
+my $groupSizes = "2:2:2:2:3:3:4:5:8";
+my $docLength = "5:60";
+my $zipfExponent = 1.1;
+my $nbTopics = 200;
+my $topicRate = 0.7;
+my $maxMesh = 12;
+my $duplicateRate = 0.001;
+
+
+sub usage {
+	my $fh = shift;
+	$fh = *STDOUT if (!defined $fh);
+	print $fh "\n";
+	print $fh "Usage: $progname [options] <output dir>\n";
+	print $fh "\n";
+	print $fh "   Generates a synthetic version of the KD data for testing and benchmarking, in\n";
+	print $fh "   <output dir>:\n";
+	print $fh "     - mined/*.out.cuis and mined/*.out.tok: KD data files (Medline abstracts format,\n";
+	print $fh "       i.e. with <pmid>.<version> in the first column).\n";
+	print $fh "     - umlsWordlist.WithIDs.txt: reference file for the term ids.\n";
+	print $fh "     - non-latest-pmid-versions.tsv: duplicate versions, as obtained with\n";
+	print $fh "       'extract-non-latest-pmid-versions.pl'.\n";
+	print $fh "     - mesh-descriptors-by-pmid.cuis.tsv: external CUIs by PMID (column 5).\n";
+	print $fh "     - pair-stats.tsv: pairs data for the unambiguous CUIs and external CUIs at\n";
+	print $fh "       the document level, with the same format as 'calculate-concept-pairs-stats.pl'.\n";
+	print $fh "     - nb-docs.txt: number of documents used for the pairs data.\n";
+	print $fh "   CUI frequencies follow a Zipf distribution; every document has a topic and\n";
+	print $fh "   most of its CUIs belong to this topic, so that the co-occurrences are informative.\n";
+	print $fh "\n";
+	print $fh "  Main options:\n";
+	print $fh "     -h print this help message\n";
+	print $fh "     -s <seed> random seed. Default: $seed.\n";
+	print $fh "     -n <nb docs> number of documents. Default: $nbDocs.\n";
+	print $fh "     -f <nb files> number of .cuis files. Default: $nbFiles.\n";
+	print $fh "     -c <nb CUIs> number of distinct CUIs. Default: $nbCuis.\n";
+	print $fh "     -g <nb groups> number of ambiguous terms. Default: $nbAmbigGroups.\n";
+	print $fh "     -a <rate> proportion of ambiguous rows. Default: $ambigRate.\n";
+	print $fh "     -G <sizes> sizes of the ambiguous groups, separated by ':'; a size is picked\n";
+	print $fh "        uniformly from this list for every group. Default: '$groupSizes'.\n";
+	print $fh "     -l <min:max> number of rows by document. Default: '$docLength'.\n";
+	print $fh "     -z <exponent> Zipf exponent for the CUIs frequency. Default: $zipfExponent.\n";
+	print $fh "     -t <nb topics> number of topics. Default: $nbTopics.\n";
+	print $fh "     -m <max> max number of external (Mesh) CUIs by document. Default: $maxMesh.\n";
+	print $fh "     -v <rate> proportion of documents with two versions. Default: $duplicateRate.\n";
+	print $fh "\n";
+}
+
+
+# returns the cumulative distribution for a Zipf distribution over $n ranks
+sub zipfCumulative {
+    my ($n, $exponent) = @_;
+    my @cumul;
+    my $total = 0;
+    for (my $rank=1; $rank<=$n; $rank++) {
+	$total += 1 / ($rank ** $exponent);
+	push(@cumul, $total);
+    }
+    return [ map { $_ / $total } @cumul ];
+}
+
+
+# returns a random index following the cumulative distribution
+sub sample {
+    my $cumul = shift;
+    my $r = rand();
+    my ($left, $right) = (0, scalar(@$cumul)-1);
+    while ($left < $right) {
+	my $mid = int(($left + $right) / 2);
+	if ($cumul->[$mid] < $r) {
+	    $left = $mid + 1;
+	} else {
+	    $right = $mid;
+	}
+    }
+    return $left;
+}
+
+
+# same as in calculate-concept-pairs-stats.pl
+sub binaryMutualInformation {
+    my ($pA, $pB, $pJoint) = @_;
+
+    my $pnAB = $pB - $pJoint;
+    my $pAnB = $pA - $pJoint;
+    my $pnAnB = 1 - ($pJoint + $pnAB + $pAnB);
+
+    my $pmi;
+    my $mi = 0;
+
+    if ($pnAnB>0) {
+	$pmi = log( $pnAnB / ( (1-$pA) * (1-$pB) ) ) / log(2) ;
+	$mi += $pnAnB * $pmi;
+    }
+    if ($pnAB>0) {
+	$pmi = log( $pnAB /  ( (1-$pA) *  $pB    ) ) / log(2);
+	$mi += $pnAB * $pmi;
+    }
+    if ($pAnB>0) {
+	$pmi = log( $pAnB /  (  $pA    * (1-$pB) ) ) / log(2);
+	$mi += $pAnB * $pmi;
+    }
+    $pmi = log( $pJoint / ( $pA    *  $pB    ) ) / log(2);
+    $mi += $pJoint * $pmi;
+
+    return ($mi, $pmi);
+}
+
+
+# PARSING OPTIONS
+my %opt;
+getopts('hs:n:f:c:g:a:G:l:z:t:m:v:', \%opt ) or  ( print STDERR "Error in options" &&  usage(*STDERR) && exit 1);
+usage(*STDOUT) && exit 0 if $opt{h};
+print STDERR "1 argument expected, but ".scalar(@ARGV)." found: ".join(" ; ", @ARGV)  && usage(*STDERR) && exit 1 if (scalar(@ARGV) != 1);
+
+$seed = $opt{s} if (defined($opt{s}));
+$nbDocs = $opt{n} if (defined($opt{n}));
+$nbFiles = $opt{f} if (defined($opt{f}));
+$nbCuis = $opt{c} if (defined($opt{c}));
+$nbAmbigGroups = $opt{g} if (defined($opt{g}));
+$ambigRate = $opt{a} if (defined($opt{a}));
+$groupSizes = $opt{G} if (defined($opt{G}));
+$docLength = $opt{l} if (defined($opt{l}));
+$zipfExponent = $opt{z} if (defined($opt{z}));
+$nbTopics = $opt{t} if (defined($opt{t}));
+$maxMesh = $opt{m} if (defined($opt{m}));
+$duplicateRate = $opt{v} if (defined($opt{v}));
+my $outputDir = $ARGV[0];
+
+my @groupSizes = split(":", $groupSizes);
+my ($minDocLength, $maxDocLength) = split(":", $docLength);
+die "Error: invalid value for -l" if (!defined($maxDocLength) || ($maxDocLength < $minDocLength));
+die "Error: the number of topics must be lower than the number of CUIs" if ($nbTopics >= $nbCuis);
+
+srand($seed);
+for my $d ($outputDir, "$outputDir/mined") {
+    if (! -d $d) {
+	mkdir $d or die "cannot create dir $d: $!";
+    }
+}
+
+# CUI number i (0-indexed) has frequency rank i+1 and belongs to topic i % nbTopics
+my @cuis = map { sprintf("C%07d", $_ + 1) } (0..$nbCuis-1);
+my $cuisCumul = zipfCumulative($nbCuis, $zipfExponent);
+my $cuisByTopicCumul = zipfCumulative(int($nbCuis / $nbTopics), $zipfExponent);
+
+# reference file: the first nbCuis ids are the unambiguous terms, then the ambiguous groups
+my $f = "$outputDir/umlsWordlist.WithIDs.txt";
+open(my $refFH, '>', $f) or die "cannot open > '$f': $!";
+for (my $i=0; $i<$nbCuis; $i++) {
+    print $refFH "$cuis[$i]\tterm$i\n";
+}
+my $nextId = $nbCuis;
+my @groupIds;   # ids string by group
+my @groupCuis;  # list of CUI numbers by group
+for (my $g=0; $g<$nbAmbigGroups; $g++) {
+    my $size = $groupSizes[int(rand(scalar(@groupSizes)))];
+    my %members;
+    while (scalar(keys %members) < $size) {
+	$members{sample($cuisCumul)} = 1;
+    }
+    my @ids;
+    foreach my $cuiNo (sort { $a <=> $b } keys %members) {
+	print $refFH "$cuis[$cuiNo]\tambiguous term $g\n";
+	push(@ids, $nextId++);
+    }
+    push(@groupIds, join(",", @ids));
+    push(@groupCuis, [ sort { $a <=> $b } keys %members ]);
+}
+close($refFH);
+my $groupsCumul = zipfCumulative($nbAmbigGroups, $zipfExponent);
+
+
+# returns a CUI number, from the topic with probability topicRate
+sub sampleCui {
+    my $topic = shift;
+    if (rand() < $topicRate) {
+	my $cuiNo = sample($cuisByTopicCumul) * $nbTopics + $topic;
+	return $cuiNo if ($cuiNo < $nbCuis);
+    }
+    return sample($cuisCumul);
+}
+
+
+my %uniFreq;
+my %jointFreq;
+my $nbDocsPairs = 0;
+$f = "$outputDir/non-latest-pmid-versions.tsv";
+open(my $nonLatestFH, '>', $f) or die "cannot open > '$f': $!";
+$f = "$outputDir/mesh-descriptors-by-pmid.cuis.tsv";
+open(my $meshFH, '>', $f) or die "cannot open > '$f': $!";
+my $pmid = 1000000;
+my $docsByFile = int(($nbDocs + $nbFiles - 1) / $nbFiles);
+for (my $fileNo=0; $fileNo<$nbFiles; $fileNo++) {
+    my $base = sprintf("$outputDir/mined/synthetic%04d.out", $fileNo);
+    open(my $cuisFH, '>', "$base.cuis") or die "cannot open > '$base.cuis': $!";
+    open(my $tokFH, '>', "$base.tok") or die "cannot open > '$base.tok': $!";
+    for (my $docNo=0; ($docNo<$docsByFile) && ($fileNo*$docsByFile+$docNo < $nbDocs); $docNo++) {
+	$pmid += 1 + int(rand(3));
+	my $year = 1980 + int(rand(42));
+	my $nbVersions = (rand() < $duplicateRate) ? 2 : 1;
+	print $nonLatestFH "$pmid\t1\n" if ($nbVersions == 2);
+	for (my $version=1; $version<=$nbVersions; $version++) {
+	    my $topic = int(rand($nbTopics));
+	    my $length = $minDocLength + int(rand($maxDocLength - $minDocLength + 1));
+	    my %docCuis;
+	    my $lastSentNo = -1;
+	    for (my $rowNo=0; $rowNo<$length; $rowNo++) {
+		my $sentNo = int($rowNo / 5);
+		my $ids;
+		if (rand() < $ambigRate) {
+		    $ids = $groupIds[sample($groupsCumul)];
+		} else {
+		    my $cuiNo = sampleCui($topic);
+		    $ids = $cuiNo;
+		    $docCuis{$cuis[$cuiNo]} = 1;
+		}
+		print $cuisFH "$pmid.$version\tabstract\t0\t$sentNo\t$ids\t".($rowNo*7)."\t".(1+int(rand(3)))."\n";
+		if ($sentNo != $lastSentNo) {
+		    print $tokFH "$pmid.$version\t$year\tabstract\t0\t$sentNo\tsynthetic sentence $sentNo\n";
+		    $lastSentNo = $sentNo;
+		}
+	    }
+	    if ($version == $nbVersions) { # latest version: mesh CUIs and pairs data
+		my %meshCuis;
+		my $nbMesh = int(rand($maxMesh + 1));
+		for (my $i=0; $i<$nbMesh; $i++) {
+		    $meshCuis{$cuis[sampleCui($topic)]} = 1;
+		}
+		print $meshFH "$pmid\t$year\tsynthetic journal\t$version\t".join(",", sort keys %meshCuis)."\n";
+		my @concepts = sort (keys %{{ %docCuis, %meshCuis }});
+		foreach my $c1 (@concepts) {
+		    $uniFreq{$c1}++;
+		    foreach my $c2 (@concepts) {
+			$jointFreq{"$c1\t$c2"}++ if ($c1 lt $c2);
+		    }
+		}
+		$nbDocsPairs++;
+	    }
+	}
+    }
+    close($cuisFH);
+    close($tokFH);
+    print STDERR "\rFile ".($fileNo+1)." / $nbFiles  ";
+}
+print STDERR "\n";
+close($nonLatestFH);
+close($meshFH);
+
+$f = "$outputDir/pair-stats.tsv";
+open(my $outFH, '>', $f) or die "cannot open > '$f': $!";
+print $outFH "C1\tC2\tfreqC1\tfreqC2\tprobC1\tprobC2\tfreqJoint\tprobJoint\tprobC1GivenC2\tprobC2GivenC1\tPMI\tbinaryMI\n";
+foreach my $pair (sort keys %jointFreq) {
+    my ($c1, $c2) = split("\t", $pair);
+    my $freqC1 = $uniFreq{$c1};
+    my $freqC2 = $uniFreq{$c2};
+    my $probC1 = $freqC1 / $nbDocsPairs;
+    my $probC2 = $freqC2 / $nbDocsPairs;
+    my $joint = $jointFreq{$pair};
+    my $jointP = $joint / $nbDocsPairs;
+    my ($mi, $pmi) = binaryMutualInformation($probC1, $probC2, $jointP);
+    print $outFH "$c1\t$c2\t$freqC1\t$freqC2\t$probC1\t$probC2\t$joint\t$jointP\t".($joint / $freqC2)."\t".($joint / $freqC1)."\t$pmi\t$mi\n";
+}
+close($outFH);
+
+$f = "$outputDir/nb-docs.txt";
+open($outFH, '>', $f) or die "cannot open > '$f': $!";
+print $outFH "$nbDocsPairs\n";
+close($outFH);
+print STDERR "$nbDocsPairs documents, ".scalar(keys %jointFreq)." pairs.\n";
@@ -0,0 +1,680 @@
+/*
+ * Disambiguation of groups of CUIs given the features (CUIs) of the document, using the pairs
+ * data: the methods of disambiguation-for-KD-output.cpp as a library, for use without the
+ * '.cuis' files.
+ *
+ * A Disambiguator contains the parameters and pointers to the pairs data loaded by the caller
+ * (see loadPairsStore() and initDisambiguatorFromStore() in pairs-store.h); it is not modified
+ * by the functions below, which use no global state: the same Disambiguator can be used by
+ * several threads at once.
+ *
+ * Example:
+ *
+ *   Disambiguator d;
+ *   initDisambiguator(d, uniFreq, jointFreq, nbDocs);
+ *   d.method = "NB";
+ *   vector<DisambiguationCase> cases(1);
+ *   cases[0].targets = { "C0000001", "C0000002" };
+ *   cases[0].features = { { "C0000003", 1 }, { "C0000004", 2 } };
+ *   vector<Decision> decisions;
+ *   disambiguateBatch(d, cases, decisions);
+ */
+
+#ifndef KD_DISAMBIGUATION_H
+#define KD_DISAMBIGUATION_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nb-kernel.h"
+#include "packed-rows.h"
+
+typedef long int INT;
+
+
+// outcome of the disambiguation of a unique ambiguity case
+enum { OUTCOME_SUCCESS, OUTCOME_UNKNOWN_TARGET, OUTCOME_METHOD_NA, OUTCOME_THRESHOLD_REJECT };
+static const char * const outcomeNames[] = { "success", "unknown target", "method NA", "threshold reject" };
+
+struct Decision {
+  int outcome;
+  int targetNo; // selected target, -1 if not applicable
+  double posterior; // probability of the selected target, -1 if not applicable
+};
+
+
+inline Decision makeDecision(int outcome, int targetNo, double posterior) {
+  Decision d;
+  d.outcome = outcome;
+  d.targetNo = targetNo;
+  d.posterior = posterior;
+  return d;
+}
+
+struct Disambiguator {
+  // pairs data, not owned: either jointFreq or packedJointFreq (jointFreq empty)
+  std::unordered_map<std::string, INT> *uniFreq;
+  std::unordered_map<std::string, std::unordered_map<std::string, INT>*> *jointFreq;
+  PackedRows *packedJointFreq; // NULL if not used
+  std::unordered_map<std::string, uint32_t> *cuiIdByName; // CUIs dictionary of packedJointFreq
+  std::vector<std::string> *cuiNames;
+  std::vector<INT> *uniFreqById; // frequency by id, decreasing: see packedIdCutoff()
+  INT totalNbDocs; // number of documents used to build the pairs data
+  // parameters, see the options of disambiguation-for-KD-output
+  std::string method; // 'basic', 'NB' or 'advanced'
+  int minConceptFreq;
+  double minPosteriorProb;
+  int ignoreTargetIfNotInPairsData;
+  int advancedDiscriminativeFeatsOnly;
+  int minFreqThresholdDone; // 1 if the pairs data contains only CUIs with frequency >= minConceptFreq
+  NBKernel nbKernel;
+};
+
+
+// default parameters, the best NB kernel for the CPU
+inline void initDisambiguator(Disambiguator &d, std::unordered_map<std::string, INT> *uniFreq, std::unordered_map<std::string, std::unordered_map<std::string, INT>*> *jointFreq, INT totalNbDocs) {
+  d.uniFreq = uniFreq;
+  d.jointFreq = jointFreq;
+  d.packedJointFreq = NULL;
+  d.cuiIdByName = NULL;
+  d.cuiNames = NULL;
+  d.uniFreqById = NULL;
+  d.totalNbDocs = totalNbDocs;
+  d.method = "advanced";
+  d.minConceptFreq = 3;
+  d.minPosteriorProb = 0.95;
+  d.ignoreTargetIfNotInPairsData = 0;
+  d.advancedDiscriminativeFeatsOnly = 1;
+  d.minFreqThresholdDone = 0;
+  d.nbKernel = selectNBKernel(NULL);
+}
+
+
+inline int validDisambiguationMethod(const std::string &method) {
+  return (method == "basic") || (method == "NB") || (method == "advanced");
+}
+
+
+// row of the CUI in the compact pairs data, beyond the last row if the CUI is unknown
+inline uint32_t packedRowOf(const std::unordered_map<std::string, uint32_t> &cuiIdByName, const std::string &cui) {
+  std::unordered_map<std::string, uint32_t>::const_iterator it = cuiIdByName.find(cui);
+  return (it != cuiIdByName.end()) ? it->second : UINT32_MAX;
+}
+
+
+/*
+ * Compact pairs data: the ids are ranked by decreasing frequency, so the CUIs with frequency >=
+ * minConceptFreq are the ids below the cutoff (all of them if the threshold is already done).
+ */
+inline uint32_t packedIdCutoff(const Disambiguator &d) {
+  if (d.minFreqThresholdDone) {
+    return UINT32_MAX;
+  }
+  const std::vector<INT> &freqs = *d.uniFreqById;
+  int minFreq = d.minConceptFreq;
+  return std::partition_point(freqs.begin(), freqs.end(), [minFreq](INT f) { return f >= minFreq; }) - freqs.begin();
+}
+
+
+/*
+ * The methods below are templates on the number of targets N: N=0 is the generic version, N>0
+ * the version specialized for groups of exactly N targets (see selectDisambiguationEngine),
+ * where the arrays by target are on the stack and the loops on the targets have a fixed length.
+ */
+#define ENGINE_MAX_FIXED_TARGETS 8
+
+// array of n elements set to 0: on the stack if N > 0 (n <= N), on the heap otherwise
+template<class T, int N>
+struct ScratchArray {
+  T fixed[(N > 0) ? N : 1];
+  std::vector<T> dynamic;
+  T *p;
+  explicit ScratchArray(int n) {
+    if (N > 0) {
+      std::fill(fixed, fixed + N, T());
+      p = fixed;
+    } else {
+      dynamic.assign(n, T());
+      p = dynamic.data();
+    }
+  }
+  T &operator[](int i) { return p[i]; }
+  T *data() { return p; }
+};
+
+
+template<int N = 0>
+inline Decision disambiguateBasic(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features) {
+  
+  int nbTargets = (N > 0) ? N : targets.size();
+  ScratchArray<INT, N> countMatches(nbTargets);
+  INT totalMatches = 0;
+  
+  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+    std::unordered_map<std::string, INT>::iterator it = features.find(targets[targetNo]);
+    if (it != features.end()) {
+      countMatches[targetNo] += it->second;
+      totalMatches += it->second;
+    }
+  }
+  if (totalMatches == 0) {
+    return makeDecision(OUTCOME_METHOD_NA, -1, -1);
+  } else {
+    int maxTargetNo = -1;
+    double maxP = -1;
+    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+      INT c = countMatches[targetNo];
+      double p = (double) c / (double) totalMatches;
+      if (p > maxP) {
+	maxTargetNo = targetNo;
+	maxP = p;
+      }
+    }
+    if (maxP > d.minPosteriorProb) {
+      return makeDecision(OUTCOME_SUCCESS, maxTargetNo, maxP);
+    } else {
+      return makeDecision(OUTCOME_THRESHOLD_REJECT, maxTargetNo, maxP);
+    }
+  }
+}
+
+
+/*
+ * The NB table depends only on the group of targets (and the parameters), not on the document:
+ * it is prepared once for all the cases with the same targets in a batch (see disambiguateBatch),
+ * the features of a case only determine which features are present.
+ */
+struct NBTable {
+  int outcome; // OUTCOME_UNKNOWN_TARGET if the method cannot be applied, -1 otherwise
+  int nbTargets;
+  int stride; // padding targets: uni=1, no joint freq
+  int nbCuis;
+  double *uniFreqTargets;
+  double *priors; // p(C)
+  std::unordered_map<std::string,int> cuis; // feature CUI -> cuiNo
+  double *featTable; // featTable[cuiNo*stride+targetNo]: joint freq of feature and target (see nb-kernel.h)
+};
+
+
+inline NBTable *prepareNBTable(const Disambiguator &d, std::vector<std::string> &targets) {
+
+  NBTable *table = new NBTable();
+  int nbTargets = targets.size();
+  int stride = nbKernelStride(d.nbKernel, nbTargets);
+  table->outcome = -1;
+  table->nbTargets = nbTargets;
+  table->stride = stride;
+  table->nbCuis = 0;
+  table->featTable = NULL;
+  double *uniFreqTargets = (double *) malloc(sizeof(double) * stride);
+  double *pTargetGivenDoc = (double *) malloc(sizeof(double) * stride);
+  table->uniFreqTargets = uniFreqTargets;
+  table->priors = pTargetGivenDoc;
+  for (int targetNo=nbTargets; targetNo<stride; targetNo++) {
+    uniFreqTargets[targetNo] = 1;
+    pTargetGivenDoc[targetNo] = 1;
+  }
+
+  std::vector<std::unordered_map<std::string, INT>*> submapsByTarget(nbTargets);
+  std::vector<uint32_t> packedRowsByTarget(nbTargets, UINT32_MAX);
+  INT rowSize = 0;
+  std::unordered_map<std::string,int> &cuis = table->cuis;
+
+  int noTargetFound = 1;
+  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+    std::string &target = targets[targetNo];
+    std::unordered_map<std::string, INT>::iterator itUni = d.uniFreq->find(target);
+    if ((itUni != d.uniFreq->end()) && (itUni->second >= d.minConceptFreq)) {
+      INT uniFreqVal = itUni->second;
+      uniFreqTargets[targetNo] = (double) uniFreqVal;
+      noTargetFound = 0;
+      std::unordered_map<std::string, std::unordered_map<std::string, INT>*>::iterator itJoint = d.jointFreq->find(target);
+      if (itJoint != d.jointFreq->end()) {
+	std::unordered_map<std::string, INT> *m = itJoint->second;
+	submapsByTarget[targetNo] = m;
+	rowSize += m->size();
+      } else {
+	submapsByTarget[targetNo] = NULL;
+      }
+      if (d.packedJointFreq != NULL) {
+	packedRowsByTarget[targetNo] = packedRowOf(*d.cuiIdByName, target);
+	rowSize += packedRowLength(*d.packedJointFreq, packedRowsByTarget[targetNo]);
+      }
+      pTargetGivenDoc[targetNo] = (double) uniFreqVal / (double) d.totalNbDocs ; // p(C)
+    } else {
+      if (!d.ignoreTargetIfNotInPairsData) {
+	table->outcome = OUTCOME_UNKNOWN_TARGET;
+	return table;
+      }
+      uniFreqTargets[targetNo] =  0;
+      pTargetGivenDoc[targetNo] = 0; // p(C)
+      submapsByTarget[targetNo] = NULL;
+
+    }
+  }
+  if (noTargetFound) {
+    table->outcome = OUTCOME_UNKNOWN_TARGET;
+    return table;
+  }
+
+  // allocate for the max possible number of features
+  double *featTable = (double *) calloc(rowSize * stride, sizeof(double));
+  table->featTable = featTable;
+  int nbCuis = 0;
+
+  uint32_t idCutoff = (d.packedJointFreq != NULL) ? packedIdCutoff(d) : 0;
+  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+    // freqOk: minimum frequency of the feature already checked
+    auto addFeature = [&](const std::string &cui, INT freqCuiThisTargetForCooc, int freqOk) {
+      std::vector<std::string>::iterator itNoTarget = std::find(targets.begin(), targets.end(), cui);
+      if (itNoTarget == targets.end()) { // now excluding any target cui from features
+	std::unordered_map<std::string,int>::iterator it0 = cuis.find(cui);
+	if (it0 == cuis.end()) {
+	  if (!freqOk) {
+	    std::unordered_map<std::string, INT>::iterator itCheckFreq = d.uniFreq->find(cui);
+	    freqOk = ((itCheckFreq != d.uniFreq->end()) && (itCheckFreq->second >= d.minConceptFreq));
+	  }
+	  if (freqOk) { // ok, include
+	    cuis.insert({cui, nbCuis});
+	    featTable[nbCuis*stride + targetNo] = (double) freqCuiThisTargetForCooc;
+	    nbCuis++;
+	  }
+	} else {  //existing
+	  featTable[it0->second*stride + targetNo] = (double) freqCuiThisTargetForCooc;
+	}
+      }
+    };
+    std::unordered_map<std::string, INT> *m = submapsByTarget[targetNo];
+    if (m != NULL) {
+      for (std::unordered_map<std::string, INT>::iterator itThis = m->begin();  itThis != m->end(); itThis++) {
+	addFeature(itThis->first, itThis->second, d.minFreqThresholdDone);
+      }
+    }
+    if (d.packedJointFreq != NULL) {
+      packedForEach(*d.packedJointFreq, packedRowsByTarget[targetNo], [&](uint32_t id, uint64_t count) { addFeature((*d.cuiNames)[id], (INT) count, 1); }, idCutoff);
+    }
+  }
+  table->nbCuis = nbCuis;
+  return table;
+
+}
+
+
+inline void freeNBTable(NBTable *table) {
+  free(table->uniFreqTargets);
+  free(table->priors);
+  free(table->featTable);
+  delete table;
+}
+
+
+// the feature flags of scoreNB(), reused by the calls of a thread: all 0 between the calls
+struct NBScratch {
+  std::vector<uint64_t> featPresent;
+  std::vector<int> setCuis; // entries of featPresent set by the current call
+};
+
+inline NBScratch &threadNBScratch() {
+  static thread_local NBScratch scratch;
+  return scratch;
+}
+
+
+// N > 0: the stride is at most N rounded up to 8 (the widest kernel)
+template<int N = 0>
+inline Decision scoreNB(const Disambiguator &d, NBTable *table, std::unordered_map<std::string, INT> &features) {
+
+  if (table->outcome >= 0) {
+    return makeDecision(table->outcome, -1, -1);
+  }
+  int nbTargets = (N > 0) ? N : table->nbTargets;
+  NBScratch &scratch = threadNBScratch();
+  if ((int) scratch.featPresent.size() < table->nbCuis) {
+    scratch.featPresent.resize(table->nbCuis, 0);
+  }
+  uint64_t *featPresent = scratch.featPresent.data(); // featPresent[cuiNo]: feature in the document
+  for (std::unordered_map<std::string, INT>::iterator it = features.begin(); it != features.end(); it++) {
+    std::unordered_map<std::string,int>::iterator it0 = table->cuis.find(it->first);
+    if (it0 != table->cuis.end()) {
+      featPresent[it0->second] = ~((uint64_t) 0);
+      scratch.setCuis.push_back(it0->second);
+    }
+  }
+  ScratchArray<double, (N > 0) ? (N + 7) / 8 * 8 : 0> pTargetGivenDoc(table->stride);
+  memcpy(pTargetGivenDoc.data(), table->priors, sizeof(double) * table->stride);
+
+  // for every target: p(C) * prod_i p(Xi|C)
+  d.nbKernel.run(table->nbCuis, table->stride, table->featTable, featPresent, table->uniFreqTargets, pTargetGivenDoc.data());
+
+  for (int cuiNo : scratch.setCuis) {
+    featPresent[cuiNo] = 0;
+  }
+  scratch.setCuis.clear();
+  double marginal = 0;
+  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+    marginal += pTargetGivenDoc[targetNo];
+  }
+  if (marginal == 0) {
+    return makeDecision(OUTCOME_METHOD_NA, -1, -1);
+  } else {
+    int maxTargetNo=-1;
+    double maxP=-1;
+    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+      double p = pTargetGivenDoc[targetNo] / marginal;
+      if (p > maxP) {
+	maxTargetNo = targetNo;
+	maxP = p;
+      }
+    }
+    if (maxP > d.minPosteriorProb) {
+      return makeDecision(OUTCOME_SUCCESS, maxTargetNo, maxP);
+    } else {
+      return makeDecision(OUTCOME_THRESHOLD_REJECT, maxTargetNo, maxP);
+    }
+  }
+
+}
+
+
+inline Decision disambiguateNB(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features) {
+
+  NBTable *table = prepareNBTable(d, targets);
+  Decision decision = scoreNB(d, table, features);
+  freeNBTable(table);
+  return decision;
+
+}
+
+
+// the flags ignoreTargetIfNotInPairsData and advancedDiscriminativeFeatsOnly are given by the template parameters
+template<int N, bool IGNORE_UNKNOWN_TARGETS, bool DISCRIMINATIVE_FEATS_ONLY>
+inline Decision disambiguateAdvancedWith(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features) {
+
+  int nbTargets = (N > 0) ? N : targets.size();
+  ScratchArray<INT, N> uniFreqTargets(nbTargets);
+  ScratchArray<INT, N> countMatches(nbTargets);
+
+  int noTargetFound = 1;
+  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+    std::string &target = targets[targetNo];
+    countMatches[targetNo] = 0;
+    std::unordered_map<std::string, INT>::iterator itUni = d.uniFreq->find(target);
+    if ((itUni != d.uniFreq->end()) && (itUni->second >= d.minConceptFreq)) {
+      INT uniFreqVal = itUni->second;
+      uniFreqTargets[targetNo] = uniFreqVal;
+      noTargetFound = 0;
+    } else {
+      if (!IGNORE_UNKNOWN_TARGETS) {
+	return makeDecision(OUTCOME_UNKNOWN_TARGET, -1, -1);
+      }
+      uniFreqTargets[targetNo] =  0;
+    }
+  }
+  if (noTargetFound) {
+    return makeDecision(OUTCOME_UNKNOWN_TARGET, -1, -1);
+  }
+
+  // compact pairs data: the targets ids sorted, for the intersection with the rows of the features
+  ScratchArray<uint32_t, N> targetIds(nbTargets);
+  ScratchArray<int, N> targetNoByIdNo(nbTargets);
+  ScratchArray<uint64_t, N> targetCounts(nbTargets);
+  ScratchArray<char, N> targetFound(nbTargets);
+  int nbTargetIds = 0;
+  if (d.packedJointFreq != NULL) {
+    ScratchArray<std::pair<uint32_t, int>, N> sortedTargets(nbTargets);
+    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+      uint32_t id = packedRowOf(*d.cuiIdByName, targets[targetNo]);
+      if (id != UINT32_MAX) {
+	sortedTargets[nbTargetIds++] = std::make_pair(id, targetNo);
+      }
+    }
+    std::sort(sortedTargets.data(), sortedTargets.data() + nbTargetIds);
+    for (int idNo=0; idNo<nbTargetIds; idNo++) {
+      targetIds[idNo] = sortedTargets[idNo].first;
+      targetNoByIdNo[idNo] = sortedTargets[idNo].second;
+    }
+  }
+
+  INT totalMatches = 0;
+  uint32_t idCutoff = (d.packedJointFreq != NULL) ? packedIdCutoff(d) : 0;
+  for (std::unordered_map<std::string, INT>::iterator it = features.begin(); it != features.end(); it++) {
+    std::string featCui = it->first;
+    if (d.packedJointFreq != NULL) {
+      // the id of the feature gives its row and the minimum frequency check
+      uint32_t row = packedRowOf(*d.cuiIdByName, featCui);
+      if ((row < idCutoff) && (packedRowLength(*d.packedJointFreq, row) > 0)) {
+	int thisFeatCountNonZeroTargets = packedIntersect(*d.packedJointFreq, row, targetIds.data(), nbTargetIds, targetCounts.data(), targetFound.data());
+	if (!DISCRIMINATIVE_FEATS_ONLY || (thisFeatCountNonZeroTargets ==1)) {
+	  for (int idNo=0; idNo<nbTargetIds; idNo++) {
+	    if (targetFound[idNo]) {
+	      countMatches[targetNoByIdNo[idNo]] += targetCounts[idNo];
+	      totalMatches += targetCounts[idNo];
+	    }
+	  }
+	}
+      }
+      continue;
+    }
+    int freqOk = d.minFreqThresholdDone;
+    if (!freqOk) {
+      std::unordered_map<std::string, INT>::iterator itCheckFreq = d.uniFreq->find(featCui);
+      freqOk = ((itCheckFreq != d.uniFreq->end()) && (itCheckFreq->second >= d.minConceptFreq));
+    }
+    if (freqOk) { // ok, include
+      std::unordered_map<std::string, std::unordered_map<std::string, INT>*>::iterator itJoint = d.jointFreq->find(featCui);
+      if (itJoint != d.jointFreq->end()) {
+	std::unordered_map<std::string, INT> *m = itJoint->second;
+	ScratchArray<INT, N> thisFeatCountByTarget(nbTargets);
+	int thisFeatCountNonZeroTargets = 0;
+	for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+	  std::unordered_map<std::string, INT>::iterator itTarget = m->find(targets[targetNo]);
+	  if (itTarget != m->end()) {
+	    thisFeatCountByTarget[targetNo] += itTarget->second;;
+	    thisFeatCountNonZeroTargets++;
+	  }
+	}
+	if (!DISCRIMINATIVE_FEATS_ONLY || (thisFeatCountNonZeroTargets ==1)) {
+	  for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+	    INT f = thisFeatCountByTarget[targetNo];
+	    countMatches[targetNo] += f;
+	    totalMatches += f;
+	  }
+	}
+      }
+    }
+    
+  }
+
+  if (totalMatches == 0) {
+    return makeDecision(OUTCOME_METHOD_NA, -1, -1);
+  } else {
+    int maxTargetNo = -1;
+    double maxP = -1;
+    for (int targetNo=0; targetNo<nbTargets; targetNo++) {
+      INT c = countMatches[targetNo];
+      double p = (double) c / (double) totalMatches;
+      if (p > maxP) {
+	maxTargetNo = targetNo;
+	maxP = p;
+      }
+    }
+    if (maxP > d.minPosteriorProb) {
+      return makeDecision(OUTCOME_SUCCESS, maxTargetNo, maxP);
+    } else {
+      return makeDecision(OUTCOME_THRESHOLD_REJECT, maxTargetNo, maxP);
+    }
+
+
+  }
+     
+
+
+  
+
+}
+
+
+inline Decision disambiguateAdvanced(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features) {
+
+  if (d.ignoreTargetIfNotInPairsData) {
+    if (d.advancedDiscriminativeFeatsOnly) {
+      return disambiguateAdvancedWith<0, true, true>(d, targets, features);
+    } else {
+      return disambiguateAdvancedWith<0, true, false>(d, targets, features);
+    }
+  } else {
+    if (d.advancedDiscriminativeFeatsOnly) {
+      return disambiguateAdvancedWith<0, false, true>(d, targets, features);
+    } else {
+      return disambiguateAdvancedWith<0, false, false>(d, targets, features);
+    }
+  }
+
+}
+
+
+/*
+ * Scoring engine: the method and the flags of a Disambiguator resolved once into the functions
+ * specialized for them, one by number of targets up to ENGINE_MAX_FIXED_TARGETS (index 0: the
+ * generic function, for the larger groups). The engine must be selected again if the method or
+ * the flags are modified.
+ *
+ * nbTable: prepared for the group if NULL (method NB), to be freed by the caller.
+ */
+typedef Decision (*DisambiguationFunction)(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features, NBTable **nbTable);
+
+struct DisambiguationEngine {
+  DisambiguationFunction bySize[ENGINE_MAX_FIXED_TARGETS+1];
+};
+
+
+template<int N>
+inline Decision basicEngine(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features, NBTable ** /*nbTable*/) {
+  return disambiguateBasic<N>(d, targets, features);
+}
+
+
+template<int N, bool IGNORE_UNKNOWN_TARGETS, bool DISCRIMINATIVE_FEATS_ONLY>
+inline Decision advancedEngine(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features, NBTable ** /*nbTable*/) {
+  return disambiguateAdvancedWith<N, IGNORE_UNKNOWN_TARGETS, DISCRIMINATIVE_FEATS_ONLY>(d, targets, features);
+}
+
+
+template<int N>
+inline Decision nbEngine(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features, NBTable **nbTable) {
+  if (*nbTable == NULL) {
+    *nbTable = prepareNBTable(d, targets);
+  }
+  return scoreNB<N>(d, *nbTable, features);
+}
+
+
+inline Decision invalidMethodEngine(const Disambiguator & /*d*/, std::vector<std::string> & /*targets*/, std::unordered_map<std::string, INT> & /*features*/, NBTable ** /*nbTable*/) {
+  return makeDecision(OUTCOME_METHOD_NA, -1, -1);
+}
+
+
+template<int N>
+inline DisambiguationFunction engineFunction(const Disambiguator &d) {
+
+  if (d.method == "basic") {
+    return basicEngine<N>;
+  } else if (d.method == "advanced") {
+    if (d.ignoreTargetIfNotInPairsData) {
+      return d.advancedDiscriminativeFeatsOnly ? advancedEngine<N, true, true> : advancedEngine<N, true, false>;
+    } else {
+      return d.advancedDiscriminativeFeatsOnly ? advancedEngine<N, false, true> : advancedEngine<N, false, false>;
+    }
+  } else if (d.method == "NB") {
+    return nbEngine<N>;
+  } else {
+    return invalidMethodEngine;
+  }
+
+}
+
+
+inline DisambiguationEngine selectDisambiguationEngine(const Disambiguator &d) {
+
+  DisambiguationEngine engine;
+  engine.bySize[0] = engineFunction<0>(d);
+  engine.bySize[1] = engineFunction<1>(d);
+  engine.bySize[2] = engineFunction<2>(d);
+  engine.bySize[3] = engineFunction<3>(d);
+  engine.bySize[4] = engineFunction<4>(d);
+  engine.bySize[5] = engineFunction<5>(d);
+  engine.bySize[6] = engineFunction<6>(d);
+  engine.bySize[7] = engineFunction<7>(d);
+  engine.bySize[8] = engineFunction<8>(d);
+  return engine;
+
+}
+
+
+// the function of the engine for a group of nbTargets targets
+inline DisambiguationFunction engineFunctionFor(const DisambiguationEngine &engine, size_t nbTargets) {
+  return engine.bySize[(nbTargets <= ENGINE_MAX_FIXED_TARGETS) ? nbTargets : 0];
+}
+
+
+// a single case: the method is resolved at every call, see selectDisambiguationEngine() for loops
+inline Decision disambiguateCase(const Disambiguator &d, std::vector<std::string> &targets, std::unordered_map<std::string, INT> &features, NBTable **nbTable) {
+  return engineFunction<0>(d)(d, targets, features, nbTable);
+}
+
+
+/*
+ * A unique ambiguity case: the CUIs in the group (after removing the ones unknown in the pairs
+ * data if needed, see option -d) and the features of the document, i.e. the non-ambiguous CUIs
+ * with their frequency (the targets excluded).
+ */
+struct DisambiguationCase {
+  std::vector<std::string> targets;
+  std::unordered_map<std::string, INT> features;
+};
+
+
+/*
+ * decisions[i] is the decision for cases[i], decisions[i].targetNo is the index in
+ * cases[i].targets. The cases with the same targets (same order) are scored together, so that
+ * the NB table is prepared once for them.
+ */
+inline void disambiguateBatch(const Disambiguator &d, std::vector<DisambiguationCase> &cases, std::vector<Decision> &decisions) {
+
+  decisions.resize(cases.size());
+  std::unordered_map<std::string, std::vector<size_t>> casesByGroup;
+  std::vector<std::string> groups; // in order of first occurrence
+  for (size_t caseNo=0; caseNo<cases.size(); caseNo++) {
+    std::string key;
+    for (std::string &target : cases[caseNo].targets) {
+      key += target + ",";
+    }
+    std::vector<size_t> &groupCases = casesByGroup[key];
+    if (groupCases.empty()) {
+      groups.push_back(key);
+    }
+    groupCases.push_back(caseNo);
+  }
+  DisambiguationEngine engine = selectDisambiguationEngine(d);
+  for (std::string &key : groups) {
+    NBTable *nbTable = NULL;
+    std::vector<size_t> &groupCases = casesByGroup[key];
+    DisambiguationFunction disambiguate = engineFunctionFor(engine, cases[groupCases[0]].targets.size());
+    for (size_t caseNo : groupCases) {
+      decisions[caseNo] = disambiguate(d, cases[caseNo].targets, cases[caseNo].features, &nbTable);
+    }
+    if (nbTable != NULL) {
+      freeNBTable(nbTable);
+    }
+  }
+
+}
+
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Placement of the large arrays of the pairs data in memory: huge pages and NUMA nodes (option
+ * -H of disambiguation-for-KD-output.cpp, used for the compact rows, see packed-rows.h).
+ *
+ * An array of at least PLACEMENT_MIN_BYTES is mapped with explicit huge pages (1 GB pages if it
+ * is at least 1 GB, otherwise 2 MB pages) if the kernel has enough of them reserved (see
+ * /proc/sys/vm/nr_hugepages), otherwise with normal pages and madvise(MADV_HUGEPAGE), i.e.
+ * transparent huge pages if they are enabled. The NUMA policy is set with mbind() before the
+ * pages are touched: interleaved over the nodes, or bound to a single node (one replica by
+ * node). There is no dependency on libnuma: the nodes are read from /sys/devices/system/node.
+ */
+
+#ifndef MEMORY_PLACEMENT_H
+#define MEMORY_PLACEMENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#define PLACEMENT_MPOL_BIND 2
+#define PLACEMENT_MPOL_INTERLEAVE 3
+
+#define PLACEMENT_MIN_BYTES ((size_t) 2 << 20) // smaller arrays are allocated with malloc
+#define PLACEMENT_HEADER 64 // a PlacementHeader is stored before the array
+
+
+enum { PLACEMENT_NUMA_DEFAULT, PLACEMENT_NUMA_INTERLEAVE, PLACEMENT_NUMA_BIND };
+
+struct MemoryPlacement {
+  int numaPolicy;
+  unsigned long nodeMask; // nodes for PLACEMENT_NUMA_INTERLEAVE or PLACEMENT_NUMA_BIND
+  // bytes currently mapped by kind of pages, for the report
+  size_t bytes1G;
+  size_t bytes2M;
+  size_t bytesTransparent;
+  size_t bytesNumaFailed; // mbind() failed, default policy
+};
+
+
+struct PlacementHeader {
+  size_t length; // mapped
+  size_t *pagesBytes; // counter of the kind of pages in the MemoryPlacement
+  int numaFailed;
+};
+
+
+struct NumaNode {
+  int id;
+  std::vector<int> cpus;
+};
+
+
+inline MemoryPlacement makeMemoryPlacement(int numaPolicy, unsigned long nodeMask) {
+  MemoryPlacement p;
+  memset(&p, 0, sizeof(p));
+  p.numaPolicy = numaPolicy;
+  p.nodeMask = nodeMask;
+  return p;
+}
+
+
+// e.g. '0-3,8-11'
+inline std::vector<int> parseCpuList(const char *s) {
+  std::vector<int> cpus;
+  while (*s != '\0' && *s != '\n') {
+    char *end;
+    long first = strtol(s, &end, 10);
+    long last = first;
+    if (end == s) {
+      break;
+    }
+    s = end;
+    if (*s == '-') {
+      last = strtol(s+1, &end, 10);
+      s = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back((int) cpu);
+    }
+    if (*s == ',') {
+      s++;
+    }
+  }
+  return cpus;
+}
+
+
+// the NUMA nodes with at least one CPU by increasing id, empty if unknown
+inline std::vector<NumaNode> numaNodes() {
+  std::vector<NumaNode> nodes;
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir == NULL) {
+    return nodes;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int id;
+    char rest;
+    if (sscanf(entry->d_name, "node%d%c", &id, &rest) != 1) {
+      continue;
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+      continue;
+    }
+    char line[4096];
+    if (fgets(line, sizeof(line), f) != NULL) {
+      NumaNode node;
+      node.id = id;
+      node.cpus = parseCpuList(line);
+      if ((node.cpus.size() > 0) && (id < (int) (8 * sizeof(unsigned long)))) {
+	nodes.push_back(node);
+      }
+    }
+    fclose(f);
+  }
+  closedir(dir);
+  std::sort(nodes.begin(), nodes.end(), [](const NumaNode &a, const NumaNode &b) { return a.id < b.id; });
+  return nodes;
+}
+
+
+// returns 0 if it fails
+inline int pinThreadToNode(pthread_t thread, const NumaNode &node) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : node.cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+
+inline void *placementMap(MemoryPlacement &p, size_t bytes) {
+
+  const size_t size2M = (size_t) 1 << 21;
+  const size_t size1G = (size_t) 1 << 30;
+  size_t needed = bytes + PLACEMENT_HEADER;
+  PlacementHeader header;
+  header.length = 0;
+  header.numaFailed = 0;
+  void *addr = MAP_FAILED;
+  if (needed >= size1G) {
+    header.length = (needed + size1G - 1) / size1G * size1G;
+    addr = mmap(NULL, header.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
+    header.pagesBytes = &p.bytes1G;
+  }
+  if (addr == MAP_FAILED) {
+    header.length = (needed + size2M - 1) / size2M * size2M;
+    addr = mmap(NULL, header.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    header.pagesBytes = &p.bytes2M;
+  }
+  if (addr == MAP_FAILED) {
+    addr = mmap(NULL, header.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    madvise(addr, header.length, MADV_HUGEPAGE); // no effect if transparent huge pages are disabled
+    header.pagesBytes = &p.bytesTransparent;
+  }
+  *header.pagesBytes += header.length;
+  if (p.numaPolicy != PLACEMENT_NUMA_DEFAULT) {
+    int mode = (p.numaPolicy == PLACEMENT_NUMA_INTERLEAVE) ? PLACEMENT_MPOL_INTERLEAVE : PLACEMENT_MPOL_BIND;
+    unsigned long mask = p.nodeMask;
+    if (syscall(SYS_mbind, addr, header.length, mode, &mask, 8 * sizeof(mask) + 1, 0) != 0) {
+      header.numaFailed = 1;
+      p.bytesNumaFailed += header.length;
+    }
+  }
+  memcpy(addr, &header, sizeof(header));
+  return (char *) addr + PLACEMENT_HEADER;
+
+}
+
+
+inline void placementUnmap(MemoryPlacement &p, void *array) {
+  void *addr = (char *) array - PLACEMENT_HEADER;
+  PlacementHeader header;
+  memcpy(&header, addr, sizeof(header));
+  *header.pagesBytes -= header.length;
+  if (header.numaFailed) {
+    p.bytesNumaFailed -= header.length;
+  }
+  munmap(addr, header.length);
+}
+
+
+/*
+ * Allocator for the vectors of the pairs data: malloc if placement is NULL (default) or for the
+ * small arrays, placementMap() otherwise. The placement must not change while it is used.
+ */
+template<class T>
+struct PlacedAllocator {
+  typedef T value_type;
+  MemoryPlacement *placement;
+
+  PlacedAllocator() : placement(NULL) {}
+  explicit PlacedAllocator(MemoryPlacement *p) : placement(p) {}
+  template<class U> PlacedAllocator(const PlacedAllocator<U> &other) : placement(other.placement) {}
+
+  bool mapped(size_t n) const {
+    return (placement != NULL) && (n * sizeof(T) >= PLACEMENT_MIN_BYTES);
+  }
+
+  T *allocate(size_t n) {
+    if (mapped(n)) {
+      return (T *) placementMap(*placement, n * sizeof(T));
+    }
+    void *array = malloc(n * sizeof(T));
+    if ((array == NULL) && (n > 0)) {
+      throw std::bad_alloc();
+    }
+    return (T *) array;
+  }
+
+  void deallocate(T *array, size_t n) {
+    if (mapped(n)) {
+      placementUnmap(*placement, array);
+    } else {
+      free(array);
+    }
+  }
+};
+
+template<class T, class U>
+inline bool operator==(const PlacedAllocator<T> &a, const PlacedAllocator<U> &b) {
+  return a.placement == b.placement;
+}
+
+template<class T, class U>
+inline bool operator!=(const PlacedAllocator<T> &a, const PlacedAllocator<U> &b) {
+  return a.placement != b.placement;
+}
+
+
+#endif
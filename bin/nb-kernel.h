@@ -0,0 +1,125 @@
+/*
+ * Scoring kernels for the NB method (see disambiguateNB() in disambiguation-for-KD-output.cpp).
+ *
+ * The features x targets table is stored by feature: joint[i*stride+t] is the joint frequency
+ * of feature i with target t, stride being the number of targets rounded up to a multiple of
+ * the number of lanes of the kernel (padding targets have joint=0 and uni=1). present[i] is
+ * all bits set if feature i is in the document, 0 otherwise. For every target t the kernel
+ * multiplies p[t] by p(Xi|t) = joint/uni[t] if feature i is present, 1-p(Xi|t) otherwise.
+ *
+ * The probabilities are multiplied in the same order as the original implementation (by
+ * feature) and without fused multiply-add, so all the kernels give exactly the same results:
+ * the vector kernels only process several targets at once.
+ */
+
+#ifndef NB_KERNEL_H
+#define NB_KERNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NB_KERNEL_X86
+#endif
+
+
+typedef void (*NBKernelFunction)(int nbFeats, int stride, const double *joint, const uint64_t *present, const double *uni, double *p);
+
+struct NBKernel {
+  const char *name;
+  int lanes;
+  NBKernelFunction run;
+};
+
+
+inline void nbKernelScalar(int nbFeats, int stride, const double *joint, const uint64_t *present, const double *uni, double *p) {
+  for (int i=0; i<nbFeats; i++) {
+    const double *row = joint + (size_t) i * stride;
+    for (int t=0; t<stride; t++) {
+      double pFeatGivenTarget = row[t] / uni[t];
+      p[t] *= present[i] ? pFeatGivenTarget : ((double) 1 - pFeatGivenTarget);
+    }
+  }
+}
+
+
+#ifdef NB_KERNEL_X86
+
+__attribute__((target("avx2")))
+inline void nbKernelAVX2(int nbFeats, int stride, const double *joint, const uint64_t *present, const double *uni, double *p) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  for (int t=0; t<stride; t+=4) {
+    __m256d u = _mm256_loadu_pd(uni + t);
+    __m256d acc = _mm256_loadu_pd(p + t);
+    for (int i=0; i<nbFeats; i++) {
+      __m256d q = _mm256_div_pd(_mm256_loadu_pd(joint + (size_t) i * stride + t), u);
+      __m256d mask = _mm256_castsi256_pd(_mm256_set1_epi64x((long long) present[i]));
+      acc = _mm256_mul_pd(acc, _mm256_blendv_pd(_mm256_sub_pd(one, q), q, mask));
+    }
+    _mm256_storeu_pd(p + t, acc);
+  }
+}
+
+
+__attribute__((target("avx512f")))
+inline void nbKernelAVX512(int nbFeats, int stride, const double *joint, const uint64_t *present, const double *uni, double *p) {
+  const __m512d one = _mm512_set1_pd(1.0);
+  for (int t=0; t<stride; t+=8) {
+    __m512d u = _mm512_loadu_pd(uni + t);
+    __m512d acc = _mm512_loadu_pd(p + t);
+    for (int i=0; i<nbFeats; i++) {
+      __m512d q = _mm512_div_pd(_mm512_loadu_pd(joint + (size_t) i * stride + t), u);
+      __mmask8 mask = (__mmask8) -(int) (present[i] != 0);
+      acc = _mm512_mul_pd(acc, _mm512_mask_blend_pd(mask, _mm512_sub_pd(one, q), q));
+    }
+    _mm512_storeu_pd(p + t, acc);
+  }
+}
+
+#endif
+
+
+/*
+ * The kernels available on this CPU, best first (the scalar kernel is always available).
+ * The kernels are bound by the divisions: AVX-512 is not faster than AVX2 for up to 8 targets
+ * on the CPUs tested (see benchmark-nb-kernel), so AVX2 is preferred.
+ */
+inline int availableNBKernels(NBKernel *kernels) {
+  int n = 0;
+#ifdef NB_KERNEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[n++] = { "avx2", 4, nbKernelAVX2 };
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    kernels[n++] = { "avx512", 8, nbKernelAVX512 };
+  }
+#endif
+  kernels[n++] = { "scalar", 1, nbKernelScalar };
+  return n;
+}
+
+
+// the best kernel available, or the one named 'name' if not NULL and available
+inline NBKernel selectNBKernel(const char *name) {
+  NBKernel kernels[3];
+  int n = availableNBKernels(kernels);
+  if (name != NULL) {
+    for (int i=0; i<n; i++) {
+      if (strcmp(kernels[i].name, name) == 0) {
+	return kernels[i];
+      }
+    }
+  }
+  return kernels[0];
+}
+
+
+inline int nbKernelStride(const NBKernel &kernel, int nbTargets) {
+  return (nbTargets + kernel.lanes - 1) / kernel.lanes * kernel.lanes;
+}
+
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ * Compact storage of the co-occurrence rows of the pairs data (option -C of
+ * disambiguation-for-KD-output.cpp).
+ *
+ * A row is the list of (neighbour id, joint frequency) of a CUI sorted by id, the ids being the
+ * ids of the CUIs dictionary of the pairs data (ranked by decreasing frequency). It is stored by blocks of up to PACKED_BLOCK_SIZE entries:
+ *
+ *   <nb entries - 1> <bits by id delta> <bits by count>   (1 byte each)
+ *   <id deltas>   nb entries - 1 values, delta - 1 between successive ids, bit-packed
+ *   <counts>      nb entries values, bit-packed
+ *
+ * The first id and the byte offset of every block are stored apart (skip pointers), so that a
+ * lookup or an intersection only decodes the blocks which can contain the ids searched for.
+ * The widths are chosen by block: most joint frequencies take a few bits only.
+ *
+ * The arrays can be placed on huge pages and NUMA nodes (see memory-placement.h) when the rows
+ * are built. A partial replica contains only the first rows, i.e. the most frequent CUIs, and
+ * refers to the shared rows for the other ones: the functions below accept both.
+ */
+
+#ifndef PACKED_ROWS_H
+#define PACKED_ROWS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#include "memory-placement.h"
+
+#define PACKED_BLOCK_SIZE 128
+#define PACKED_MAX_BITS 56 // a value is read with a single unaligned 64 bits load
+
+template<class T>
+using PackedVector = std::vector<T, PlacedAllocator<T>>;
+
+struct PackedRows {
+  PackedVector<uint64_t> rowFirstBlock; // blocks of row r: rowFirstBlock[r] .. rowFirstBlock[r+1]-1
+  PackedVector<uint32_t> rowLength; // number of entries of row r
+  PackedVector<uint32_t> blockFirstId;
+  PackedVector<uint64_t> blockOffset; // in data
+  PackedVector<uint8_t> data;
+  const PackedRows *shared; // partial replica: the rows from rowLength.size() on, NULL otherwise
+
+  PackedRows() : shared(NULL) {}
+  explicit PackedRows(MemoryPlacement *placement) : rowFirstBlock(PlacedAllocator<uint64_t>(placement)), rowLength(PlacedAllocator<uint32_t>(placement)),
+						    blockFirstId(PlacedAllocator<uint32_t>(placement)), blockOffset(PlacedAllocator<uint64_t>(placement)), data(PlacedAllocator<uint8_t>(placement)),
+						    shared(NULL) {}
+};
+
+
+inline int packedBitsFor(uint64_t v) {
+  int bits = 0;
+  while (v > 0) {
+    bits++;
+    v >>= 1;
+  }
+  return bits;
+}
+
+
+inline void packedAppendBits(PackedVector<uint8_t> &data, uint64_t &acc, int &accBits, uint64_t v, int bits) {
+  for (int done = 0; done < bits; ) {
+    int n = bits - done;
+    if (n > 64 - accBits) {
+      n = 64 - accBits;
+    }
+    if (n > 32) {
+      n = 32;
+    }
+    acc |= ((v >> done) & ((((uint64_t) 1) << n) - 1)) << accBits;
+    accBits += n;
+    done += n;
+    while (accBits >= 8) {
+      data.push_back((uint8_t) acc);
+      acc >>= 8;
+      accBits -= 8;
+    }
+  }
+}
+
+
+inline uint64_t packedReadBits(const uint8_t *base, uint64_t bitPos, int bits) {
+  uint64_t w;
+  memcpy(&w, base + (bitPos >> 3), sizeof(w));
+  return (w >> (bitPos & 7)) & ((((uint64_t) 1) << bits) - 1);
+}
+
+
+// bits of the id deltas and of the counts in the block of entries start .. end-1
+inline void packedBlockBits(const uint32_t *ids, const uint64_t *counts, size_t start, size_t end, int &deltaBits, int &countBits) {
+  uint64_t maxDelta = 0;
+  uint64_t maxCount = 0;
+  for (size_t i = start; i < end; i++) {
+    if ((i > start) && (ids[i] - ids[i-1] - 1 > maxDelta)) {
+      maxDelta = ids[i] - ids[i-1] - 1;
+    }
+    if (counts[i] > maxCount) {
+      maxCount = counts[i];
+    }
+  }
+  deltaBits = packedBitsFor(maxDelta);
+  countBits = packedBitsFor(maxCount);
+}
+
+
+// size in bytes of a row of n entries in the data, see packedRowsReserve()
+inline uint64_t packedRowBytes(const uint32_t *ids, const uint64_t *counts, size_t n) {
+  uint64_t bytes = 0;
+  for (size_t start = 0; start < n; start += PACKED_BLOCK_SIZE) {
+    size_t end = (start + PACKED_BLOCK_SIZE < n) ? start + PACKED_BLOCK_SIZE : n;
+    int deltaBits, countBits;
+    packedBlockBits(ids, counts, start, end, deltaBits, countBits);
+    bytes += 3 + ((end - start - 1) * deltaBits + (end - start) * countBits + 7) / 8;
+  }
+  return bytes;
+}
+
+
+/*
+ * Optional, before the first row: space for nbRows rows, nbBlocks blocks and dataBytes bytes of
+ * data (the sum of packedRowBytes() for the rows). With the exact sizes the arrays are allocated
+ * once: neither the appends nor packedRowsFinish() copy them.
+ */
+inline void packedRowsReserve(PackedRows &p, size_t nbRows, uint64_t nbBlocks, uint64_t dataBytes) {
+  p.rowFirstBlock.reserve(nbRows+1);
+  p.rowLength.reserve(nbRows);
+  p.blockFirstId.reserve(nbBlocks);
+  p.blockOffset.reserve(nbBlocks);
+  p.data.reserve(dataBytes + sizeof(uint64_t)); // padding, see packedRowsFinish()
+}
+
+
+/*
+ * Appends row 'row' with n entries, ids strictly increasing. Rows must be appended in increasing
+ * order, the rows skipped are empty. Returns 0 if a count is too large to be packed.
+ */
+inline int packedRowsAppend(PackedRows &p, uint32_t row, const uint32_t *ids, const uint64_t *counts, size_t n) {
+  if (p.rowFirstBlock.empty()) {
+    p.rowFirstBlock.push_back(0);
+  }
+  while (p.rowLength.size() <= row) {
+    p.rowLength.push_back(0);
+    p.rowFirstBlock.push_back(p.blockFirstId.size());
+  }
+  p.rowLength[row] = n;
+  for (size_t start = 0; start < n; start += PACKED_BLOCK_SIZE) {
+    size_t end = (start + PACKED_BLOCK_SIZE < n) ? start + PACKED_BLOCK_SIZE : n;
+    int deltaBits, countBits;
+    packedBlockBits(ids, counts, start, end, deltaBits, countBits);
+    if (countBits > PACKED_MAX_BITS) {
+      return 0;
+    }
+    p.blockFirstId.push_back(ids[start]);
+    p.blockOffset.push_back(p.data.size());
+    p.data.push_back((uint8_t) (end - start - 1));
+    p.data.push_back((uint8_t) deltaBits);
+    p.data.push_back((uint8_t) countBits);
+    uint64_t acc = 0;
+    int accBits = 0;
+    for (size_t i = start + 1; i < end; i++) {
+      packedAppendBits(p.data, acc, accBits, ids[i] - ids[i-1] - 1, deltaBits);
+    }
+    for (size_t i = start; i < end; i++) {
+      packedAppendBits(p.data, acc, accBits, counts[i], countBits);
+    }
+    if (accBits > 0) {
+      p.data.push_back((uint8_t) acc);
+    }
+  }
+  p.rowFirstBlock.back() = p.blockFirstId.size();
+  return 1;
+}
+
+
+// to be called after the last row: nbRows is the total number of rows, the last ones can be empty
+inline void packedRowsFinish(PackedRows &p, size_t nbRows) {
+  if (p.rowFirstBlock.empty()) {
+    p.rowFirstBlock.push_back(0);
+  }
+  while (p.rowLength.size() < nbRows) {
+    p.rowLength.push_back(0);
+    p.rowFirstBlock.push_back(p.blockFirstId.size());
+  }
+  p.data.insert(p.data.end(), sizeof(uint64_t), 0); // padding for packedReadBits
+  // no copy if the sizes were reserved exactly
+  p.data.shrink_to_fit();
+  p.blockFirstId.shrink_to_fit();
+  p.blockOffset.shrink_to_fit();
+}
+
+
+// the rows which contain row: p, or the shared rows if p is a partial replica without it
+inline const PackedRows &packedRowsOf(const PackedRows &p, uint32_t row) {
+  return ((row >= p.rowLength.size()) && (p.shared != NULL)) ? *p.shared : p;
+}
+
+
+inline size_t packedRowsNb(const PackedRows &p) {
+  return (p.shared != NULL) ? p.shared->rowLength.size() : p.rowLength.size();
+}
+
+
+inline size_t packedRowLength(const PackedRows &rows, uint32_t row) {
+  const PackedRows &p = packedRowsOf(rows, row);
+  return (row < p.rowLength.size()) ? p.rowLength[row] : 0;
+}
+
+
+// decodes block b into ids and counts (PACKED_BLOCK_SIZE entries at most), returns the number of entries
+inline int packedDecodeBlock(const PackedRows &p, uint64_t b, uint32_t *ids, uint64_t *counts) {
+  const uint8_t *block = &p.data[p.blockOffset[b]];
+  int n = (int) block[0] + 1;
+  int deltaBits = block[1];
+  int countBits = block[2];
+  const uint8_t *bits = block + 3;
+  uint64_t bitPos = 0;
+  uint32_t id = p.blockFirstId[b];
+  ids[0] = id;
+  if (deltaBits == 0) {
+    for (int i = 1; i < n; i++) {
+      ids[i] = ++id;
+    }
+  } else {
+    for (int i = 1; i < n; i++) {
+      id += (uint32_t) packedReadBits(bits, bitPos, deltaBits) + 1;
+      ids[i] = id;
+      bitPos += deltaBits;
+    }
+  }
+  if (countBits == 0) {
+    for (int i = 0; i < n; i++) {
+      counts[i] = 0;
+    }
+  } else {
+    for (int i = 0; i < n; i++) {
+      counts[i] = packedReadBits(bits, bitPos, countBits);
+      bitPos += countBits;
+    }
+  }
+  return n;
+}
+
+
+// calls f(id, count) for every entry of the row with id < endId, by increasing id
+template<class F>
+inline void packedForEach(const PackedRows &rows, uint32_t row, F f, uint32_t endId = UINT32_MAX) {
+  const PackedRows &p = packedRowsOf(rows, row);
+  if (row >= p.rowLength.size()) {
+    return;
+  }
+  uint32_t ids[PACKED_BLOCK_SIZE];
+  uint64_t counts[PACKED_BLOCK_SIZE];
+  for (uint64_t b = p.rowFirstBlock[row]; (b < p.rowFirstBlock[row+1]) && (p.blockFirstId[b] < endId); b++) {
+    int n = packedDecodeBlock(p, b, ids, counts);
+    for (int i = 0; (i < n) && (ids[i] < endId); i++) {
+      f(ids[i], counts[i]);
+    }
+  }
+}
+
+
+// last block of the row which can contain id (first id <= id), or the end of the row if none
+inline uint64_t packedFindBlock(const PackedRows &p, uint32_t row, uint64_t from, uint32_t id) {
+  uint64_t end = p.rowFirstBlock[row+1];
+  if ((from >= end) || (p.blockFirstId[from] > id)) {
+    return end;
+  }
+  uint64_t lo = from;
+  uint64_t hi = end;
+  while (hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (p.blockFirstId[mid] <= id) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+
+// returns 1 and sets *count if the row contains id, 0 otherwise
+inline int packedLookup(const PackedRows &rows, uint32_t row, uint32_t id, uint64_t *count) {
+  const PackedRows &p = packedRowsOf(rows, row);
+  if (row >= p.rowLength.size()) {
+    return 0;
+  }
+  uint64_t b = packedFindBlock(p, row, p.rowFirstBlock[row], id);
+  if (b == p.rowFirstBlock[row+1]) {
+    return 0;
+  }
+  uint32_t ids[PACKED_BLOCK_SIZE];
+  uint64_t counts[PACKED_BLOCK_SIZE];
+  int n = packedDecodeBlock(p, b, ids, counts);
+  int lo = 0;
+  int hi = n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ids[mid] < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if ((lo < n) && (ids[lo] == id)) {
+    *count = counts[lo];
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+ * Intersection of the row with the sorted ids queryIds[0..n-1]: found[i] is set to 1 and
+ * counts[i] to the count if the row contains queryIds[i], found[i] to 0 otherwise. Returns the
+ * number of ids found. Every block is decoded at most once, the blocks which cannot contain any
+ * of the ids are skipped.
+ */
+inline int packedIntersect(const PackedRows &rows, uint32_t row, const uint32_t *queryIds, int n, uint64_t *counts, char *found) {
+  const PackedRows &p = packedRowsOf(rows, row);
+  memset(found, 0, n);
+  if (row >= p.rowLength.size()) {
+    return 0;
+  }
+  uint32_t ids[PACKED_BLOCK_SIZE];
+  uint64_t blockCounts[PACKED_BLOCK_SIZE];
+  uint64_t end = p.rowFirstBlock[row+1];
+  uint64_t decoded = end;
+  int nbDecoded = 0;
+  int pos = 0;
+  int nbFound = 0;
+  uint64_t b = p.rowFirstBlock[row];
+  for (int q = 0; q < n; q++) {
+    uint64_t qb = packedFindBlock(p, row, b, queryIds[q]);
+    if (qb == end) {
+      continue; // before the first block of the row
+    }
+    b = qb;
+    if (b != decoded) {
+      nbDecoded = packedDecodeBlock(p, b, ids, blockCounts);
+      decoded = b;
+      pos = 0;
+    }
+    while ((pos < nbDecoded) && (ids[pos] < queryIds[q])) {
+      pos++;
+    }
+    if ((pos < nbDecoded) && (ids[pos] == queryIds[q])) {
+      found[q] = 1;
+      counts[q] = blockCounts[pos];
+      nbFound++;
+    }
+  }
+  return nbFound;
+}
+
+
+// the arrays of p only, not the shared rows of a partial replica
+inline size_t packedRowsBytes(const PackedRows &p) {
+  return p.rowFirstBlock.capacity() * sizeof(uint64_t) + p.rowLength.capacity() * sizeof(uint32_t) + p.blockFirstId.capacity() * sizeof(uint32_t) + p.blockOffset.capacity() * sizeof(uint64_t) + p.data.capacity();
+}
+
+
+#endif
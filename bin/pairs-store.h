@@ -0,0 +1,497 @@
+/*
+ * Loading of the pairs data for a Disambiguator (see kd-disambiguation.h): the loaders of
+ * disambiguation-for-KD-output.cpp, for use without the program.
+ *
+ * The pairs file is the output of the pairs statistics, with a header line and one line by pair:
+ * <C1> <C2> <freq C1> <freq C2> ... <joint freq> (column 7) ... <PMI> (column 11, only needed
+ * with a PMI floor). The pairs with a CUI below minFreq are ignored; the pairs below the joint
+ * frequency or PMI floor are counted in uniFreq but not added to the rows.
+ *
+ * The rows are either hash maps (jointFreq) or compact rows (packedJointFreq, see packed-rows.h)
+ * with their own CUIs dictionary, where the ids are ranked by decreasing frequency.
+ *
+ * Example:
+ *
+ *   PairsStore store;
+ *   initPairsStore(store);
+ *   PairsStoreOptions o;
+ *   initPairsStoreOptions(o);
+ *   o.compact = 1;
+ *   std::string error;
+ *   if (!loadPairsStore(store, "pair-stats.tsv", o, error)) { ... }
+ *   Disambiguator d;
+ *   initDisambiguatorFromStore(d, store, nbDocs);
+ *   ...
+ *   freePairsStore(store);
+ */
+
+#ifndef PAIRS_STORE_H
+#define PAIRS_STORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "kd-disambiguation.h"
+#include "packed-rows.h"
+
+#define FNV1A_OFFSET_BASIS 14695981039346656037ULL
+
+
+struct PairsStore {
+  std::unordered_map<std::string, INT> uniFreq;
+  std::unordered_map<std::string, std::unordered_map<std::string, INT>*> jointFreq; // empty if compact
+  PackedRows *packedJointFreq; // compact rows (the first replica if any), NULL otherwise
+  // partial replicas of the compact rows, one by placement of PairsStoreOptions.replicaPlacements
+  std::vector<PackedRows *> packedReplicas;
+  // CUIs dictionary of packedJointFreq, ids by decreasing frequency (ties by name)
+  std::vector<std::string> cuiNames;
+  std::unordered_map<std::string, uint32_t> cuiIdByName;
+  std::vector<INT> uniFreqById;
+  // if not NULL, receives all the pairs regardless of the floors and of topK (hash maps only),
+  // freed with the store
+  std::unordered_map<std::string, std::unordered_map<std::string, INT>*> *fullJointFreq;
+};
+
+
+struct PairsStoreOptions {
+  int compact; // compact rows instead of hash maps
+  int minFreq;
+  INT minJointFreq;
+  double minPMI; // -INFINITY: no PMI floor
+  INT topK; // rows truncated to the top K CUIs if > 0, see truncateJointFreq()
+  uint64_t *fingerprint; // if not NULL, FNV-1a hash updated with the lines of the file
+  int progress; // number of lines read printed to stderr
+  // compact rows: placement of the arrays (see memory-placement.h), NULL for malloc
+  MemoryPlacement *placement;
+  // compact rows: the rows of the most frequent CUIs, up to this proportion of the entries, are
+  // built with every placement of replicaPlacements (e.g. one by NUMA node) instead of placement
+  std::vector<MemoryPlacement *> replicaPlacements;
+  double replicatedEntries;
+};
+
+
+inline void initPairsStore(PairsStore &s) {
+  s.packedJointFreq = NULL;
+  s.fullJointFreq = NULL;
+}
+
+
+inline void initPairsStoreOptions(PairsStoreOptions &o) {
+  o.compact = 0;
+  o.minFreq = 1;
+  o.minJointFreq = 0;
+  o.minPMI = -INFINITY;
+  o.topK = 0;
+  o.fingerprint = NULL;
+  o.progress = 0;
+  o.placement = NULL;
+  o.replicaPlacements.clear();
+  o.replicatedEntries = 0;
+}
+
+
+// 64 bits FNV-1a hash
+inline uint64_t fnv1a(const void *data, size_t n, uint64_t h = FNV1A_OFFSET_BASIS) {
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (size_t i=0; i<n; i++) {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+inline void pairsStoreColumns(const std::string &line, std::vector<std::string> &cols) {
+  cols.clear();
+  size_t prevPos = 0;
+  size_t pos = line.find('\t');
+  while (pos != std::string::npos) {
+    cols.push_back(line.substr(prevPos, pos-prevPos));
+    prevPos = pos+1;
+    pos = line.find('\t', prevPos);
+  }
+  cols.push_back(line.substr(prevPos));
+}
+
+
+inline std::string pairsStoreLineError(const std::string &message, const std::string &filename, INT lineNo) {
+  return "Error: " + message + " in " + filename + " line " + std::to_string(lineNo+1);
+}
+
+
+// joint frequency and PMI floors: 1 if the pair is kept, 0 if not, -1 if there is no PMI column
+inline int pairAboveFloors(const std::vector<std::string> &cols, INT jointFreqVal, const PairsStoreOptions &o) {
+  if (jointFreqVal < o.minJointFreq) {
+    return 0;
+  }
+  if (o.minPMI > -INFINITY) {
+    if (cols.size() < 11) {
+      return -1;
+    }
+    return (strtod(cols[10].c_str(), NULL) >= o.minPMI);
+  }
+  return 1;
+}
+
+
+// the first value of a pair is kept
+inline void jointMapAdd(std::unordered_map<std::string, std::unordered_map<std::string, INT>*> *jointFreq, const std::string &cui1, const std::string &cui2, INT jointFreqVal) {
+  std::unordered_map<std::string, std::unordered_map<std::string, INT>*>::iterator it = jointFreq->find(cui1);
+  std::unordered_map<std::string, INT> *submap;
+  if (it != jointFreq->end()) {
+    submap = it->second;
+  } else {
+    submap = new std::unordered_map<std::string, INT>();
+    jointFreq->insert({cui1, submap});
+  }
+  submap->insert({ cui2, jointFreqVal });
+}
+
+
+/*
+ * Reads the lines of the pairs file: processPair(cols, freqC1, freqC2, jointFreqVal, kept, lineNo,
+ * error) is called for every pair with both CUIs >= minFreq, kept is 0 if the pair is below the
+ * floors; it returns 0 and sets error if the pair is not valid. Returns 0 and sets error if the
+ * file cannot be read or a line is not valid.
+ */
+template<class ProcessPair>
+int readPairsLines(const std::string &filename, const PairsStoreOptions &o, std::string &error, ProcessPair processPair) {
+  std::ifstream file(filename);
+  if (!file) {
+    error = "Error opening " + filename;
+    return 0;
+  }
+  std::string str;
+  std::vector<std::string> cols;
+  getline(file, str); // skip header
+  INT lineNo=1;
+  while (getline(file, str)) {
+    if (o.progress && (lineNo % 8192 == 0)) {
+      fprintf(stderr,"\r%ld", (long) lineNo);
+    }
+    if (o.fingerprint != NULL) {
+      *o.fingerprint = fnv1a(str.data(), str.length(), *o.fingerprint);
+      *o.fingerprint = fnv1a("\n", 1, *o.fingerprint);
+    }
+    pairsStoreColumns(str, cols);
+    if (cols.size() < 7) {
+      error = pairsStoreLineError("missing columns", filename, lineNo);
+      return 0;
+    }
+    INT freqC1 = strtol(cols[2].c_str(), NULL,10);
+    INT freqC2 = strtol(cols[3].c_str(), NULL,10);
+    if ((freqC1 >= o.minFreq) && (freqC2 >= o.minFreq)) {
+      INT jointFreqVal = strtol(cols[6].c_str(), NULL,10);
+      int kept = pairAboveFloors(cols, jointFreqVal, o);
+      if (kept < 0) {
+	error = pairsStoreLineError("no PMI column", filename, lineNo);
+	return 0;
+      }
+      if (!processPair(cols, freqC1, freqC2, jointFreqVal, kept, lineNo, error)) {
+	return 0;
+      }
+    }
+    lineNo++;
+  }
+  if (o.progress) {
+    fprintf(stderr, "\n");
+  }
+  return 1;
+}
+
+
+// hash maps, without truncation
+inline int readPairsData(const std::string &filename, PairsStore &s, const PairsStoreOptions &o, std::string &error) {
+  return readPairsLines(filename, o, error, [&s](const std::vector<std::string> &cols, INT freqC1, INT freqC2, INT jointFreqVal, int kept, INT, std::string &) {
+      s.uniFreq.insert({ cols[0], freqC1 });
+      s.uniFreq.insert({ cols[1], freqC2 });
+      if (s.fullJointFreq != NULL) {
+	jointMapAdd(s.fullJointFreq, cols[0], cols[1], jointFreqVal);
+	jointMapAdd(s.fullJointFreq, cols[1], cols[0], jointFreqVal);
+      }
+      if (kept) {
+	jointMapAdd(&s.jointFreq, cols[0], cols[1], jointFreqVal);
+	jointMapAdd(&s.jointFreq, cols[1], cols[0], jointFreqVal);
+      }
+      return 1;
+    });
+}
+
+
+/*
+ * Keeps only the K CUIs with the highest joint frequency in every row (ties: lowest CUI first).
+ * The other entries are erased in place, so the remaining ones stay in the same order: with
+ * successive values of K in decreasing order the result is the same as truncating the full data.
+ */
+inline void truncateJointFreq(std::unordered_map<std::string, std::unordered_map<std::string, INT>*> *jointFreq, INT K) {
+
+  for (std::unordered_map<std::string, std::unordered_map<std::string, INT>*>::iterator it = jointFreq->begin(); it != jointFreq->end(); it++) {
+    std::unordered_map<std::string, INT> *m = it->second;
+    if ((INT) m->size() <= K) {
+      continue;
+    }
+    std::vector<std::pair<INT, const std::string *>> entries;
+    entries.reserve(m->size());
+    for (std::unordered_map<std::string, INT>::iterator itThis = m->begin(); itThis != m->end(); itThis++) {
+      entries.push_back({itThis->second, &itThis->first});
+    }
+    std::nth_element(entries.begin(), entries.begin()+K, entries.end(), [](const std::pair<INT, const std::string *> &a, const std::pair<INT, const std::string *> &b) {
+	return (a.first > b.first) || ((a.first == b.first) && (*a.second < *b.second));
+      });
+    std::vector<std::string> removed;
+    for (size_t i=K; i<entries.size(); i++) {
+      removed.push_back(*entries[i].second);
+    }
+    for (std::string &cui : removed) {
+      m->erase(cui);
+    }
+  }
+
+}
+
+
+/*
+ * Compact rows (see packed-rows.h) instead of jointFreq. The pairs are first collected as CUI
+ * ids (12 bytes by pair), then distributed by row, sorted and packed; the rows are truncated to
+ * the top K CUIs if topK > 0. The result is the same as readPairsData() followed by
+ * truncateJointFreq().
+ *
+ * The CUIs are numbered in their own dictionary (cuiNames) by decreasing frequency (ties by
+ * name), so that the minimum frequency of a feature is checked by comparing its id with a cutoff
+ * and a row is cut at the cutoff: the same rows serve every minimum frequency.
+ *
+ * The rows are built directly with their placement. With replicaPlacements, the first rows (the
+ * most frequent CUIs, which are also the longest and most used) are built once by replica and
+ * the other rows once, in the rows shared by the replicas: packedJointFreq is the first replica.
+ */
+inline int readPairsDataPacked(const std::string &filename, PairsStore &s, const PairsStoreOptions &o, std::string &error) {
+
+  // ids in order of first occurrence while reading, like uniFreq the first frequency is kept
+  auto pairsCuiId = [&s](const std::string &cui, INT freq) -> uint32_t {
+    std::unordered_map<std::string, uint32_t>::iterator it = s.cuiIdByName.find(cui);
+    if (it != s.cuiIdByName.end()) {
+      return it->second;
+    }
+    uint32_t id = s.cuiNames.size();
+    s.cuiNames.push_back(cui);
+    s.uniFreqById.push_back(freq);
+    s.cuiIdByName.insert({cui, id});
+    return id;
+  };
+  std::vector<uint32_t> pairs; // <id C1> <id C2> <joint freq>
+  int ok = readPairsLines(filename, o, error, [&](const std::vector<std::string> &cols, INT freqC1, INT freqC2, INT jointFreqVal, int kept, INT lineNo, std::string &lineError) {
+      s.uniFreq.insert({ cols[0], freqC1 });
+      s.uniFreq.insert({ cols[1], freqC2 });
+      uint32_t id1 = pairsCuiId(cols[0], freqC1);
+      uint32_t id2 = pairsCuiId(cols[1], freqC2);
+      if (kept) {
+	if ((jointFreqVal < 0) || (jointFreqVal > UINT32_MAX)) {
+	  lineError = pairsStoreLineError("joint frequency out of range", filename, lineNo);
+	  return 0;
+	}
+	pairs.push_back(id1);
+	pairs.push_back(id2);
+	pairs.push_back((uint32_t) jointFreqVal);
+      }
+      return 1;
+    });
+  if (!ok) {
+    return 0;
+  }
+
+  // renumbering by decreasing frequency
+  size_t nbRows = s.cuiNames.size();
+  std::vector<uint32_t> byRank(nbRows);
+  for (size_t id=0; id<nbRows; id++) {
+    byRank[id] = id;
+  }
+  std::sort(byRank.begin(), byRank.end(), [&s](uint32_t a, uint32_t b) {
+      return (s.uniFreqById[a] > s.uniFreqById[b]) || ((s.uniFreqById[a] == s.uniFreqById[b]) && (s.cuiNames[a] < s.cuiNames[b]));
+    });
+  std::vector<uint32_t> rankOf(nbRows);
+  std::vector<std::string> names(nbRows);
+  std::vector<INT> freqs(nbRows);
+  for (size_t rank=0; rank<nbRows; rank++) {
+    rankOf[byRank[rank]] = rank;
+    names[rank].swap(s.cuiNames[byRank[rank]]);
+    freqs[rank] = s.uniFreqById[byRank[rank]];
+  }
+  s.cuiNames.swap(names);
+  s.uniFreqById.swap(freqs);
+  for (std::unordered_map<std::string, uint32_t>::iterator it = s.cuiIdByName.begin(); it != s.cuiIdByName.end(); it++) {
+    it->second = rankOf[it->second];
+  }
+  for (size_t i=0; i<pairs.size(); i+=3) {
+    pairs[i] = rankOf[pairs[i]];
+    pairs[i+1] = rankOf[pairs[i+1]];
+  }
+  std::vector<uint32_t>().swap(byRank);
+  std::vector<uint32_t>().swap(rankOf);
+
+  // both directions, by row in the order of the file
+  std::vector<uint64_t> rowStart(nbRows+1, 0);
+  for (size_t i=0; i<pairs.size(); i+=3) {
+    rowStart[pairs[i]+1]++;
+    rowStart[pairs[i+1]+1]++;
+  }
+  for (size_t row=0; row<nbRows; row++) {
+    rowStart[row+1] += rowStart[row];
+  }
+  std::vector<std::pair<uint32_t, uint32_t>> entries(rowStart[nbRows]); // <id> <joint freq>
+  std::vector<uint64_t> next(rowStart.begin(), rowStart.end()-1);
+  for (size_t i=0; i<pairs.size(); i+=3) {
+    entries[next[pairs[i]]++] = { pairs[i+1], pairs[i+2] };
+    entries[next[pairs[i+1]]++] = { pairs[i], pairs[i+2] };
+  }
+  std::vector<uint32_t>().swap(pairs);
+  std::vector<uint64_t>().swap(next);
+
+  // the rows in place: sorted by id, first occurrence of a pair kept (like jointMapAdd), top K
+  std::vector<uint32_t> rowEntries(nbRows);
+  for (size_t row=0; row<nbRows; row++) {
+    std::vector<std::pair<uint32_t, uint32_t>>::iterator first = entries.begin() + rowStart[row];
+    std::vector<std::pair<uint32_t, uint32_t>>::iterator last = entries.begin() + rowStart[row+1];
+    std::stable_sort(first, last, [](const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b) { return a.first < b.first; });
+    last = std::unique(first, last, [](const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b) { return a.first == b.first; });
+    if ((o.topK > 0) && (last - first > o.topK)) {
+      std::nth_element(first, first+o.topK, last, [&s](const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b) {
+	  return (a.second > b.second) || ((a.second == b.second) && (s.cuiNames[a.first] < s.cuiNames[b.first]));
+	});
+      last = first + o.topK;
+      std::sort(first, last);
+    }
+    rowEntries[row] = last - first;
+  }
+  std::vector<uint32_t> ids;
+  std::vector<uint64_t> counts;
+  auto rowArrays = [&](size_t row) {
+    ids.clear();
+    counts.clear();
+    for (uint64_t i = rowStart[row]; i < rowStart[row] + rowEntries[row]; i++) {
+      ids.push_back(entries[i].first);
+      counts.push_back(entries[i].second);
+    }
+  };
+
+  // replicated rows: the first ones up to the proportion of the entries
+  size_t hotRows = 0;
+  if (!o.replicaPlacements.empty()) {
+    double totalEntries = 0;
+    for (size_t row=0; row<nbRows; row++) {
+      totalEntries += rowEntries[row];
+    }
+    double hotEntries = 0;
+    while ((hotRows < nbRows) && (hotEntries < o.replicatedEntries * totalEntries)) {
+      hotEntries += rowEntries[hotRows];
+      hotRows++;
+    }
+  }
+  // exact sizes: every array is allocated once
+  uint64_t blocks[2] = { 0, 0 }; // other rows, hot rows
+  uint64_t dataBytes[2] = { 0, 0 };
+  for (size_t row=0; row<nbRows; row++) {
+    rowArrays(row);
+    int hot = (row < hotRows);
+    blocks[hot] += (ids.size() + PACKED_BLOCK_SIZE - 1) / PACKED_BLOCK_SIZE;
+    dataBytes[hot] += packedRowBytes(ids.data(), counts.data(), ids.size());
+  }
+  PackedRows *packed = new PackedRows(o.placement);
+  packedRowsReserve(*packed, nbRows, blocks[0], dataBytes[0]);
+  for (MemoryPlacement *placement : o.replicaPlacements) {
+    s.packedReplicas.push_back(new PackedRows(placement));
+    packedRowsReserve(*s.packedReplicas.back(), hotRows, blocks[1], dataBytes[1]);
+  }
+  for (size_t row=0; row<nbRows; row++) {
+    rowArrays(row);
+    if (ids.size() == 0) {
+      continue;
+    }
+    if (row < hotRows) {
+      for (PackedRows *replica : s.packedReplicas) {
+	packedRowsAppend(*replica, row, ids.data(), counts.data(), ids.size());
+      }
+    } else {
+      packedRowsAppend(*packed, row, ids.data(), counts.data(), ids.size());
+    }
+  }
+  packedRowsFinish(*packed, nbRows);
+  for (PackedRows *replica : s.packedReplicas) {
+    packedRowsFinish(*replica, hotRows);
+    replica->shared = packed;
+  }
+  s.packedJointFreq = s.packedReplicas.empty() ? packed : s.packedReplicas[0];
+  return 1;
+
+}
+
+
+// reads the pairs file into the store, returns 0 and sets error if it fails
+inline int loadPairsStore(PairsStore &s, const std::string &filename, const PairsStoreOptions &o, std::string &error) {
+  if (o.compact) {
+    return readPairsDataPacked(filename, s, o, error);
+  }
+  if (!readPairsData(filename, s, o, error)) {
+    return 0;
+  }
+  if (o.topK > 0) {
+    truncateJointFreq(&s.jointFreq, o.topK);
+  }
+  return 1;
+}
+
+
+// default parameters (see initDisambiguator()), using the pairs data of the store
+inline void initDisambiguatorFromStore(Disambiguator &d, PairsStore &s, INT totalNbDocs) {
+  initDisambiguator(d, &s.uniFreq, &s.jointFreq, totalNbDocs);
+  if (s.packedJointFreq != NULL) {
+    d.packedJointFreq = s.packedJointFreq;
+    d.cuiIdByName = &s.cuiIdByName;
+    d.cuiNames = &s.cuiNames;
+    d.uniFreqById = &s.uniFreqById;
+  }
+}
+
+
+inline void freeJointFreq(std::unordered_map<std::string, std::unordered_map<std::string, INT>*> &jointFreq) {
+  for (std::unordered_map<std::string, std::unordered_map<std::string, INT>*>::iterator it = jointFreq.begin(); it != jointFreq.end(); it++) {
+    delete it->second;
+  }
+  jointFreq.clear();
+}
+
+
+// releases the pairs data of the store, which can then be loaded again
+inline void freePairsStore(PairsStore &s) {
+  freeJointFreq(s.jointFreq);
+  if (s.fullJointFreq != NULL) {
+    freeJointFreq(*s.fullJointFreq);
+    delete s.fullJointFreq;
+    s.fullJointFreq = NULL;
+  }
+  // the replicas share the rows which are not replicated
+  if (!s.packedReplicas.empty()) {
+    delete s.packedReplicas[0]->shared;
+    for (PackedRows *replica : s.packedReplicas) {
+      delete replica;
+    }
+    s.packedReplicas.clear();
+  } else {
+    delete s.packedJointFreq;
+  }
+  s.packedJointFreq = NULL;
+  s.uniFreq.clear();
+  s.cuiNames.clear();
+  s.cuiIdByName.clear();
+  s.uniFreqById.clear();
+}
+
+
+#endif
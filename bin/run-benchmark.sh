@@ -0,0 +1,134 @@
+#!/bin/bash
+
+DIR="$( cd "$( dirname "$0" )" && pwd )"
+
+scales="1000 5000 20000"
+
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <work dir> [nb docs scales...]" 1>&2
+    echo 1>&2
+    echo "  Runs the main steps of the process on synthetic data generated with" 1>&2
+    echo "  'generate-synthetic-kd-data.pl', for every scale (number of documents)." 1>&2
+    echo "  Default scales: $scales." 1>&2
+    echo "  The synthetic data is generated only if not already present in <work dir>." 1>&2
+    echo "  Requires 'disambiguation-for-KD-output' compiled in the same dir as this script." 1>&2
+    echo 1>&2
+    echo "  The results are printed to STDOUT and appended to '<work dir>/benchmark.tsv'," 1>&2
+    echo "  one line per scale and step with the following tab-separated columns:" 1>&2
+    echo "    <version> <nb docs> <step> <seconds> <peak RSS KB> <rows> <rows per second>" 1>&2
+    echo "  where <version> is the git commit of this script's repository." 1>&2
+    echo "  Step 'load' is the time spent loading the pairs data, as reported in the" 1>&2
+    echo "  '.stats.json' file of step 'NB'." 1>&2
+    echo "  Step 'io-wait' is the time step 'NB' spent waiting for reading the input files" 1>&2
+    echo "  and writing the output (see option -I of 'disambiguation-for-KD-output')." 1>&2
+    echo "  Note: the peak RSS of the perl steps is sampled every 0.1s." 1>&2
+    echo 1>&2
+    echo "  Environment variables for the disambiguation steps:" 1>&2
+    echo "    DISAMB_OPTS     additional options, e.g. '-C -H interleave -t 8 -I 16'." 1>&2
+    echo "    DISAMB_LAUNCHER command prefix, e.g. 'numactl --cpunodebind=0 --membind=0'." 1>&2
+    echo 1>&2
+    exit 1
+fi
+
+workdir="$1"
+shift
+if [ $# -gt 0 ]; then
+    scales="$@"
+fi
+
+prog="$DIR/disambiguation-for-KD-output"
+if [ ! -x "$prog" ]; then
+    echo "Error: '$prog' not found, it must be compiled first" 1>&2
+    exit 1
+fi
+
+version=$(cd "$DIR" && git rev-parse --short HEAD 2>/dev/null)
+[ -z "$version" ] && version="unknown"
+
+[ -d "$workdir" ] || mkdir "$workdir"
+
+
+# value for key $2 in the JSON file $1 (first occurrence)
+function jsonValue {
+    grep "\"$2\":" "$1" | head -n 1 | sed "s/.*\"$2\": *\([^ ,}]*\).*/\1/"
+}
+
+
+# runs the command given as arguments, sets 'seconds' and 'peakKB' (sampled)
+function measure {
+    local start=$(date +%s.%N)
+    "$@" &
+    local pid=$!
+    peakKB=0
+    while kill -0 $pid 2>/dev/null; do
+	local kb=$(grep VmHWM /proc/$pid/status 2>/dev/null | awk '{print $2}')
+	if [ ! -z "$kb" ] && [ $kb -gt $peakKB ]; then
+	    peakKB=$kb
+	fi
+	sleep 0.1
+    done
+    wait $pid
+    local status=$?
+    seconds=$(awk "BEGIN { print $(date +%s.%N) - $start }")
+    if [ $status -ne 0 ]; then
+	echo "Error: command failed: $@" 1>&2
+	exit 1
+    fi
+}
+
+
+function report {
+    local scale="$1"
+    local step="$2"
+    local rows="$3"
+    local rowsPerSec=$(awk "BEGIN { if ($seconds > 0) printf \"%.1f\", $rows / $seconds; else print 0 }")
+    local line=$(printf "%s\t%s\t%s\t%.3f\t%s\t%s\t%s" "$version" "$scale" "$step" "$seconds" "$peakKB" "$rows" "$rowsPerSec")
+    echo "$line"
+    echo "$line" >> "$workdir/benchmark.tsv"
+}
+
+
+# runs a disambiguation step, the peak RSS is the one reported by the program
+function disambStep {
+    local scale="$1"
+    local step="$2"
+    local inputDir="$3"
+    shift 3
+    local outDir="$d/$step"
+    rm -rf "$outDir" "$outDir.stats" "$outDir.stats.json"
+    measure bash -c "ls \"$inputDir\"/*.cuis | $DISAMB_LAUNCHER \"$prog\" $DISAMB_OPTS $* \"$nbDocs\" \"$d/pair-stats.tsv\" \"$outDir\" 2>/dev/null"
+    peakKB=$(jsonValue "$outDir.stats.json" peakRSSKB)
+    report "$scale" "$step" $(jsonValue "$outDir.stats.json" rows)
+}
+
+
+for scale in $scales; do
+    d="$workdir/synthetic.$scale"
+    if [ ! -f "$d/nb-docs.txt" ]; then
+	echo "Generating synthetic data for $scale documents in '$d'" 1>&2
+	nbFiles=$(( (scale + 4999) / 5000 ))
+	"$DIR/generate-synthetic-kd-data.pl" -n "$scale" -f "$nbFiles" "$d" 2>/dev/null
+	if [ $? -ne 0 ]; then
+	    echo "Error generating data in '$d'" 1>&2
+	    exit 1
+	fi
+    fi
+    nbDocs=$(cat "$d/nb-docs.txt")
+    rows=$(cat "$d"/mined/*.cuis | wc -l)
+
+    disambStep "$scale" "basic" "$d/mined" -D "$d/non-latest-pmid-versions.tsv" -r "$d/umlsWordlist.WithIDs.txt" -b 0.95 -a basic
+    disambStep "$scale" "advanced" "$d/basic" -b 0.95 -f 1 -a advanced -d -e "$d/mesh-descriptors-by-pmid.cuis.tsv:1:5:,"
+    disambStep "$scale" "NB" "$d/advanced" -b 0.95 -f 1 -a NB -d -e "$d/mesh-descriptors-by-pmid.cuis.tsv:1:5:,"
+    seconds=$(jsonValue "$d/NB.stats.json" pairs)
+    peakKB=$(jsonValue "$d/NB.stats.json" peakRSSKB)
+    report "$scale" "load" $(( $(wc -l < "$d/pair-stats.tsv") - 1 ))
+    seconds=$(awk "BEGIN { print $(jsonValue "$d/NB.stats.json" inputWait) + $(jsonValue "$d/NB.stats.json" outputWait) }")
+    report "$scale" "io-wait" $(jsonValue "$d/NB.stats.json" rows)
+
+    measure "$DIR/build-doc-concept-matrix.pl" -D "$d/non-latest-pmid-versions.tsv" -r "$d/umlsWordlist.WithIDs.txt" -o -d 1 -e "$d/mesh-descriptors-by-pmid.cuis.tsv:1:5:," -u "$d/mined" "$d/doc-cui-matrix.tsv" >/dev/null
+    report "$scale" "matrix" "$rows"
+
+    measure "$DIR/calculate-concept-pairs-stats.pl" -n "$d/doc-cui-matrix.tsv" 3 "$d/pair-stats.from-matrix.tsv" 2>/dev/null
+    report "$scale" "pairs" $(wc -l < "$d/doc-cui-matrix.tsv")
+done
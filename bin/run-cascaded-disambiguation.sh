@@ -5,8 +5,8 @@ DIR="$( cd "$( dirname "$0" )" && pwd )"
 
 
 
-if [ $# -ne 7 ]; then
-    echo "usage: $0 <input cuis files> <specific output dir> <intermediate data dir> <umls words file> <unambiguous pairs file> <nb docs> <mesh by pmid file>" 1>&2
+if [ $# -ne 7 ] && [ $# -ne 8 ]; then
+    echo "usage: $0 <input cuis files> <specific output dir> <intermediate data dir> <umls words file> <unambiguous pairs file> <nb docs> <mesh by pmid file> [non-latest pmid versions file]" 1>&2
     echo 1>&2
     echo "  Runs the full cascading disambiguation process for a list of cuis files given" 1>&2
     echo "  on STDIN." 1>&2
@@ -17,6 +17,8 @@ if [ $# -ne 7 ]; then
     echo "  requires the number of documents  <nb docs> used to build the <unambiguous pairs file> = " 1>&2
     echo "  pair-stats.abstracts+articles.by-paper.unambiguous.with-converted-mesh.mesh.tsv" 1>&2
     echo "  <mesh by pmid file> = mesh-descriptors-by-pmid.deduplicated.mesh.tsv" 1>&2
+    echo "  [non-latest pmid versions file] if provided, the input abstracts are" 1>&2
+    echo "  deduplicated on the fly during the first step (option -D)." 1>&2
     echo 1>&2
     exit 1
 fi
@@ -28,6 +30,7 @@ umlsWordsFile="$4"
 pairsFile="$5"
 nbDocs="$6"
 meshbypmidFile="$7"
+nonLatestFile="$8"
 
 
 d="$targetdir"
@@ -51,6 +54,15 @@ if [ ! -f "$meshbypmidFile" ]; then
     exit 1
 fi
 
+dedupOpt=""
+if [ ! -z "$nonLatestFile" ]; then
+    if [ ! -f "$nonLatestFile" ]; then
+	echo "Error: file '$nonLatestFile' doesnt exist" 1>&2
+	exit 1
+    fi
+    dedupOpt="-D $nonLatestFile"
+fi
+
 d="$workdir"
 [ -d "$d" ] || mkdir "$d"
 
@@ -60,7 +72,7 @@ cat "$inputFiles" > "$workdir"/input.files
 basicDir="$workdir/1.basic"
 [ -d "$basicDir" ] || mkdir "$basicDir"
 echo "*** STEP $basicDir"
-cat "$workdir"/input.files | $DIR/disambiguation-for-KD-output -r umlsWordlist.WithIDs.txt -b 0.95 -a basic "$nbDocs" "$pairsFile" "$basicDir"
+cat "$workdir"/input.files | $DIR/disambiguation-for-KD-output $dedupOpt -r umlsWordlist.WithIDs.txt -b 0.95 -a basic "$nbDocs" "$pairsFile" "$basicDir"
 if [ $? -ne 0 ]; then
     echo "Error step $basicDir" 1>&2
     exit 1
@@ -80,7 +92,7 @@ echo
 nbDir="$workdir/3.NB"
 [ -d "$nbDir" ] || mkdir "$nbDir"
 echo "*** STEP $nbDir"
-ls "$advDir"/*.cuis | disambiguation-for-KD-output -b 0.95 -f 1 -a NB -d -e "$meshbypmidFile:1:5:,"  "$nbDocs" "$pairsFile" "$nbDir"
+ls "$advDir"/*.cuis | disambiguation-for-KD-output -W 1000 -b 0.95 -f 1 -a NB -d -e "$meshbypmidFile:1:5:,"  "$nbDocs" "$pairsFile" "$nbDir"
 if [ $? -ne 0 ]; then
     echo "Error step $nbDir" 1>&2
     exit 1